@@ -8,6 +8,9 @@ struct buf {
   struct buf *prev; // LRU cache list
   struct buf *next;
   struct buf *qnext; // disk queue
+  uint nblocks;      // if not 0, transfer nblocks blocks from blockno on
+  char **pages;      // ... to or from these pages instead of data
+  uint nsect;        // ... of which this many sectors are done
   uchar data[BSIZE];
 };
 #define B_VALID 0x2 // buffer has been read from disk
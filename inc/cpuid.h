@@ -148,3 +148,4 @@ enum {
 };
 
 void cpuid_print(void);
+bool cpu_has(unsigned int);
@@ -5,10 +5,13 @@ struct buf;
 struct context;
 struct extent;
 struct inode;
+struct kmem_cache;
 struct proc;
+struct shm;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
+struct spawn_action;
 struct stat;
 struct superblock;
 struct vpage_info;
@@ -21,6 +24,33 @@ extern int pages_in_use;
 extern int pages_in_swap;
 extern int free_pages;
 extern int num_page_faults;
+extern int num_minor_faults;
+extern int num_major_faults;
+extern int exec_count;
+extern uint64_t exec_cycles;
+extern int spawn_count;
+extern uint64_t spawn_cycles;
+extern int vspace_full_updates;
+extern int vspace_range_updates;
+extern int cr3_loads;
+extern int cr3_flushes;
+extern int pcid_rollovers;
+extern int faultaround;
+extern int faultaround_mapped;
+extern int faultaround_used;
+extern int faultaround_unused;
+extern int evictions;
+extern int refaults;
+extern int zeropage_faults;
+extern int swap_outs;
+extern int swap_ins;
+extern int swap_ahead;
+extern int swap_ios;
+extern int zswapmax;
+extern int zswap_pages;
+extern int zswap_bytes;
+extern int zswap_hits;
+extern int zswap_misses;
 extern int num_disk_reads;
 
 extern int crashn_enable;
@@ -57,6 +87,7 @@ void consoleintr(int (*)(void));
 noreturn void panic(char *);
 
 // exec.c
+int execload(struct proc *, struct vspace *, char *, char **);
 int exec(char *, char **);
 
 // fs.c
@@ -91,13 +122,24 @@ void ioapicinit(void);
 
 // kalloc.c
 struct core_map_entry *pa2page(uint64_t pa);
+uint64_t page2pa(struct core_map_entry *);
 void detect_memory(void);
 char *kalloc(void);
-void kfree(char *);
+void kfree(void *);
+char *kalloc_zeroed(void);
+char *kalloc_prezeroed(void);
+int kzero_idle(void);
+void kzero_stats(int *, int *, int *);
+char *kalloc_pages(int);
+char *kalloc_split(int);
+void kfree_pages(char *, int);
+int kalloc_nfree(int);
+void kalloc_bench(void);
 void mem_init(void *);
-void mark_user_mem(uint64_t, uint64_t);
+void mem_init_late(void);
+void mark_user_mem(uint64_t, uint64_t, pml4e_t *);
 void mark_kernel_mem(uint64_t);
-struct core_map_entry *get_random_user_page();
+struct core_map_entry *clock_next(int *);
 
 // kbd.c
 void kbdintr(void);
@@ -111,31 +153,77 @@ void lapicinit(void);
 void lapicstartap(uchar, uint);
 void microdelay(int);
 
+// lz.c
+#define LZ_HASHBITS 12 // lz_compress() needs 1 << LZ_HASHBITS ushorts
+int lz_compress(const uchar *, uint, uchar *, uint, ushort *);
+int lz_decompress(const uchar *, uint, uchar *, uint);
+
 // mp.c
 extern int ismp;
 void mpinit(void);
 
 // vspace.c
 void vspacebootinit(void);
+void vspacetlbinit(void);
 int vspaceinit(struct vspace *);
 void vspaceinitcode(struct vspace *, char *, uint64_t);
 int vspaceloadcode(struct vspace *, char *, uint64_t *);
 void vspaceupdate(struct vspace *);
+int vspaceupdaterange(struct vspace *, uint64_t, uint64_t);
 void vspacemarknotpresent(struct vspace *, uint64_t);
 void vspaceinstall(struct proc *);
 void vspaceinstallkern(void);
 void vspacefree(struct vspace *);
 struct vregion *va2vregion(struct vspace *, uint64_t);
 struct vpage_info *va2vpage_info(struct vregion *, uint64_t);
+struct vpage_info *vregionlookup(struct vregion *, uint64_t);
 int vregioncontains(struct vregion *, uint64_t, int);
 int vspacecopy(struct vspace *, struct vspace *);
+int vspacecowfault(struct vspace *, uint64_t);
+int vspacefault(struct vspace *, uint64_t, int);
+int vspacepopulate(struct vspace *, uint64_t, uint64_t);
+uint64_t vspacegrowheap(struct vspace *, int);
+uint64_t vspacemmap(struct vspace *, uint64_t, uint64_t, int, int,
+                    struct inode *, uint);
+int vspacemunmap(struct vspace *, uint64_t, uint64_t);
+int vspacereclaim(int);
+int zeropage_maps(void);
+uint64_t vspacemapshm(struct vspace *, struct shm *, char **, int);
+int vspaceshmdetach(struct vspace *, uint64_t);
 int vspaceinitstack(struct vspace *, uint64_t);
 int vspacewritetova(struct vspace *, uint64_t, char *, int);
 void vspacedumpstack(struct vspace *);
 void vspacedumpcode(struct vspace *);
+void vspacebench(void);
 int vregionaddmap(struct vregion *, uint64_t, uint64_t, short, short);
 int vregiondelmap(struct vregion *, uint64_t, uint64_t);
 
+// pagecache.c
+void pagecacheinit(void);
+char *pagecache_get(struct inode *, uint);
+char *pagecache_getcached(struct inode *, uint);
+char *pagecache_peek(struct inode *, uint);
+int pagecache_has(struct inode *, uint, char *);
+void pagecache_drop(struct inode *, uint);
+int pagecache_read(struct inode *, char *, uint, uint);
+void pagecache_stats(int *, int *, int *, int *);
+
+// shm.c
+void shminit(void);
+int shmcreate(int, uint);
+uint64_t shmattach(int);
+struct shm *shmdup(struct shm *);
+void shmrelease(struct shm *);
+int shmremove(int);
+
+// swap.c
+void swapinit(uint, struct superblock *);
+int swapalloc(char **, int, int *);
+void swapout(uint, int);
+void swapin(uint, char **, int);
+void swapdup(uint);
+void swapfree(uint);
+
 // picirq.c
 void picenable(int);
 void picinit(void);
@@ -143,8 +231,13 @@ void picinit(void);
 // proc.c
 void exit(void);
 int fork(void);
+int spawn(char *, char **, struct spawn_action *, int);
+struct vspace *findvspace(pml4e_t *);
 int growproc(int);
 int kill(int);
+void lockptable(void);
+void unlockptable(void);
+int holdingptable(void);
 void pinit(void);
 void procdump(void);
 noreturn void scheduler(void);
@@ -159,6 +252,15 @@ void reboot(void);
 // swtch.S
 void swtch(struct context **, struct context *);
 
+// slab.c
+struct kmem_cache *kmem_cache_create(char *, uint, void (*)(void *));
+void *kmem_cache_alloc(struct kmem_cache *);
+void kmem_cache_free(struct kmem_cache *, void *);
+void kmemdump(void);
+void kmallocinit(void);
+void *kmalloc(uint);
+void kmalloc_large_free(int);
+
 // spinlock.c
 void acquire(struct spinlock *);
 void getcallerpcs(void *, uint64_t *);
@@ -208,9 +310,14 @@ void uartputc(int);
 #define NELEM(x) (sizeof(x) / sizeof((x)[0]))
 
 // file.c
+void fileinit(void);
 int file_open(int, char *);
 int file_close(int);
 int file_read(int, char *, int);
 int file_write(int, char *, int);
 int file_dup(int);
+void file_copyfds(struct proc *, struct proc *);
+int file_spawnact(struct proc *, struct spawn_action *);
+void file_closeall(struct proc *);
 int file_stat(int, struct stat *);
+int pipe(int *);
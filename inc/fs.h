@@ -11,7 +11,7 @@
 
 // Disk layout:
 // [ boot block | super block | free bit map |
-//                                          inode file | data blocks]
+//                             inode file | data blocks | swap area ]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -20,6 +20,8 @@ struct superblock {
   uint nblocks;    // Number of data blocks
   uint bmapstart;  // Block number of first free map block
   uint inodestart; // Block number of the start of inode file
+  uint swapstart;  // Block number of the start of the swap area
+  uint nswap;      // Number of swap blocks
 };
 
 // On-disk inode structure
@@ -28,9 +28,28 @@
 #define DEVBASE 0xFFFFFFFF40000000
 #define KERNLINK (KERNBASE + EXTMEM) // Address where kernel is linked
 
-#define V2P(a) (((uint64_t)(a)) - KERNBASE)
-#define P2V(a) (((void *)(a)) + KERNBASE)
+// All of physical memory is mapped at DMAPBASE, up to DMAPSIZE bytes.
+// The kernel image itself runs from its link address above KERNBASE.
+// The boot page table in entry.S maps only the first BOOTMAPSIZE bytes
+// of both ranges.
+#define DMAPBASE 0xFFFF800000000000
+#define DMAPSIZE SZ_512G
+#define BOOTMAPSIZE SZ_1G
+
+// V2P accepts both direct map and kernel image addresses.
+#define V2P(a)                                                                 \
+  ({                                                                           \
+    uint64_t __va = (uint64_t)(a);                                             \
+    __va >= KERNBASE ? __va - KERNBASE : __va - DMAPBASE;                      \
+  })
+#define P2V(a) (((void *)(a)) + DMAPBASE)
 #define IO2V(a) (((void *)(a)) + 0xFFFFFFFF00000000)
 
-#define V2P_WO(x) ((x)-KERNBASE)   // same as V2P, but without casts
-#define P2V_WO(x) ((x) + KERNBASE) // same as P2V, but without casts
+// mmap() places file mappings in [MMAPBASE, MMAPTOP) of a user
+// address space, between the heap and the stack.
+#define MMAPBASE SZ_1G
+#define MMAPTOP (SZ_1G + SZ_1G / 2)
+
+// for the kernel image only, without casts, for use in assembly
+#define V2P_WO(x) ((x)-KERNBASE)
+#define P2V_WO(x) ((x) + KERNBASE)
@@ -0,0 +1,9 @@
+#pragma once
+
+// mmap() protection bits
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+// mmap() flags, exactly one of which must be given
+#define MAP_SHARED 0x1  // writes are seen by every mapping and by read()
+#define MAP_PRIVATE 0x2 // writes go to a private copy of the page
@@ -22,6 +22,12 @@
 #define CR4_OSXMMEXCPT BIT32(10)
 #define CR4_VMXE BIT32(13)
 #define CR4_FSGSBASE BIT32(16)
+#define CR4_PCIDE BIT32(17)
+
+// CR3 with CR4_PCIDE set: the low bits name the PCID of the page
+// table, and setting CR3_NOFLUSH on a write keeps its TLB entries.
+#define CR3_PCID BITMASK64(11, 0)
+#define CR3_NOFLUSH BIT64(63)
 
 #define FLAGS_CF BIT64(0)    /* carry flag */
 #define FLAGS_FIXED BIT64(1) /* always 1 */
@@ -152,8 +158,20 @@ struct segdesc {
 
 struct core_map_entry {
   int available;
+  int ref;      // number of vspaces mapping an allocated page, plus one
+                // if it is in the page cache
   short user;   // 0 if kernel allocated memory, otherwise is user
   uint64_t va;  // if it is used by kernel only, this field is 0
+  pml4e_t *pgtbl; // page table that last mapped the user page at va
+  short order;  // block order if first page of a buddy block, otherwise -1
+  short kmlarge; // first page of a large kmalloc() block
+  union {
+    struct {                     // free list links, only valid if available
+      struct core_map_entry *next;
+      struct core_map_entry *prev;
+    };
+    struct slab *slab;           // owning slab, if allocated by slab.c
+  };
 };
 
 #endif
@@ -9,10 +9,27 @@
 #define NDEV 10        // maximum major device number
 #define ROOTDEV 1      // device number of file system root disk
 #define MAXARG 32      // max exec arguments
+#define KMAGSIZE 32    // free pages cached per cpu
+#define KMAGBATCH 16   // pages moved per magazine refill/drain
+#define KALLOC_NORDER 11 // buddy block orders, up to 2^10 pages
+#define KZEROPOOL 256  // pages zeroed ahead of time by idle cpus
+#define MAXSTACKPAGES 10 // user stack growth limit
+#define FAULTAROUNDMAX 512 // largest fault-around window, in pages
+#define NPCACHE 256    // pages of file data kept in the page cache
+#define NMMAP 8        // mmap() regions per process
+#define RECLAIMLOW 32  // free pages below which page faults reclaim
+#define RECLAIMBATCH 8 // pages reclaimed at a time
+#define SWAPCLUSTER 8  // most pages moved to or from swap in one request
+#define ZSWAPMAX 2048  // default KB of compressed pages kept in memory
+#define NSHM 16        // shared memory segments per system
+#define SHMMAXPG 512   // largest shared memory segment, in pages
+#define KMALLOC_MINSHIFT 4  // smallest kmalloc size class is 16 bytes
+#define KMALLOC_MAXSHIFT 11 // largest is 2KB, bigger requests get pages
 #define MAXOPBLOCKS 10 // max # of blocks any FS op writes
 
 #define LOGSIZE (MAXOPBLOCKS * 3) // max data blocks in on-disk log
 #define NBUF (MAXOPBLOCKS * 3)    // size of disk block cache
 #define FSSIZE 50000             // size of file system in blocks
+#define SWAPBLOCKS 16384         // ... of which the swap area takes the last
 #define MAXCODEPAGES 256
 #define MAXPATHLEN 20
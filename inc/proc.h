@@ -5,6 +5,15 @@
 #include <segment.h>
 #include <vspace.h>
 
+// Per-CPU cache of free physical pages, see kalloc.c
+struct kmag {
+  int count;               // number of cached pages
+  char *pages[KMAGSIZE];   // cached pages, used as a stack
+  uint hits;               // allocations served without refilling
+  uint refills;            // batches taken from the global pool
+  uint drains;             // batches returned to the global pool
+};
+
 // Per-CPU state
 struct cpu {
   uchar apicid;              // Local APIC ID
@@ -14,6 +23,9 @@ struct cpu {
   volatile uint started;     // Has the CPU started?
   int ncli;                  // Depth of pushcli nesting.
   int intena;                // Were interrupts enabled before pushcli?
+  struct kmag kmag;          // Free page magazine
+  uint pcidnext;             // Next free PCID of this generation
+  uint pcidgen;              // PCID generation, see vspacecr3()
 
   struct cpu *cpu;
   struct proc *proc;
@@ -90,6 +102,8 @@ struct proc {
   int killed;                      // If non-zero, have been killed
   char name[16];                   // Process name (debugging)
   struct file_info *files[NOFILE]; // Files
+  uint64_t exectsc;                // rdtsc() at exec(), until its first fault
+  uint64_t spawntsc;               // rdtsc() at spawn(), until its first fault
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <spinlock.h>
+
+#define NKMEMCACHE 16 // maximum number of object caches
+
+// A slab is a naturally aligned block of 2^order pages. This header
+// sits at its start and the objects follow it.
+struct slab {
+  struct kmem_cache *cache; // cache the slab belongs to
+  struct slab *prev;        // links in the cache's partial/full/empty list
+  struct slab *next;
+  char *freelist;           // first free object
+  int inuse;                // number of allocated objects
+};
+
+// A cache of equally sized kernel objects.
+struct kmem_cache {
+  char *name;
+  uint size;              // object size
+  uint slotsize;          // bytes used per object in the slab
+  uint freeoff;           // offset of the free list link in a free object
+  int order;              // each slab is 2^order pages
+  int perslab;            // objects per slab
+  void (*ctor)(void *);   // run once on each object when its slab is made
+  struct spinlock lock;
+  struct slab *partial;   // slabs with both free and allocated objects
+  struct slab *full;      // slabs with no free objects
+  struct slab *empty;     // at most one slab with no allocated objects
+
+  // statistics
+  uint nslabs;            // slabs currently owned by the cache
+  uint active;            // objects currently allocated
+  uint allocs;            // total allocations
+  uint frees;             // total frees
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+// spawn() file actions, applied in order to the child's descriptors,
+// which start out as copies of the caller's
+#define SPAWN_OPEN 1  // open path with mode as descriptor fd
+#define SPAWN_DUP2 2  // make newfd refer to what fd refers to
+#define SPAWN_CLOSE 3 // close fd
+
+#define NSPAWNACT 8 // file actions per spawn()
+
+struct spawn_action {
+  int op;     // SPAWN_ constant
+  int fd;
+  int newfd;  // SPAWN_DUP2 only
+  int mode;   // SPAWN_OPEN only
+  char *path; // SPAWN_OPEN only
+};
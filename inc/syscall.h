@@ -22,3 +22,11 @@
 #define SYS_close 21
 #define SYS_sysinfo 22
 #define SYS_crashn 23
+#define SYS_vmtune 24
+#define SYS_mmap 25
+#define SYS_munmap 26
+#define SYS_spawn 27
+#define SYS_shmcreate 28
+#define SYS_shmattach 29
+#define SYS_shmdetach 30
+#define SYS_shmremove 31
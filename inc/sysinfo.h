@@ -1,9 +1,49 @@
 #pragma once
 
+#include <param.h>
+
 struct sys_info {
   int pages_in_use;
   int pages_in_swap;
   int free_pages;
   int num_page_faults;
+  int num_minor_faults; // page faults resolved without I/O
+  int num_major_faults; // page faults that read the page in
   int num_disk_reads;
+  int kmag_hits;    // page allocations served from a per-cpu magazine
+  int kmag_refills; // magazine refills from the global free list
+  int kmag_drains;  // magazine drains to the global free list
+  int free_blocks[KALLOC_NORDER]; // free buddy blocks of each order
+  int zero_hits;   // pages handed out from the zeroed pool
+  int zero_misses; // kalloc_zeroed() calls that zeroed a page inline
+  int zero_pool;   // pages currently in the zeroed pool
+  int vspace_full_updates;  // page tables rebuilt by vspaceupdate()
+  int vspace_range_updates; // ranges patched by vspaceupdaterange()
+  int cr3_loads;      // user page tables installed
+  int cr3_flushes;    // ... that flushed the vspace's TLB entries
+  int pcid_rollovers; // whole-TLB flushes to recycle PCIDs
+  int faultaround_mapped; // pages mapped speculatively around a fault
+  int faultaround_used;   // ... found accessed afterwards
+  int faultaround_unused; // ... freed without ever being accessed
+  int evictions; // pages evicted by the clock under memory pressure
+  int refaults;  // ... that were faulted back in
+  int zeropage_maps;   // heap and stack pages mapped to the zero page
+  int zeropage_faults; // read faults that mapped it
+  int swap_outs;  // pages written out to swap
+  int swap_ins;   // pages read back from swap by the faults on them
+  int swap_ahead; // ... read along with them
+  int swap_ios;   // disk requests that moved them
+  int zswap_pages;  // swapped pages kept compressed in memory
+  int zswap_bytes;  // ... and their compressed size
+  int zswap_max;    // upper bound on zswap_bytes, in KB
+  int zswap_hits;   // swapped pages read back from memory
+  int zswap_misses; // ... and from the disk
+  int pcache_pages;  // file pages in the page cache
+  int pcache_shared; // ... mapped by more than one vspace
+  int pcache_hits;   // file page faults served from the page cache
+  int pcache_misses; // ... that had to read the file
+  int exec_count;         // exec()s that reached their first instruction
+  uint64_t exec_cycles;   // total cycles from exec() to first instruction
+  int spawn_count;        // spawn()ed children that reached their first one
+  uint64_t spawn_cycles;  // total cycles from spawn() to first instruction
 };
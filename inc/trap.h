@@ -26,6 +26,11 @@
 #define TRAP_VC 29 /* VMM communication */
 #define TRAP_SX 30 /* security */
 
+/* page fault error code bits */
+#define PF_P 0x1 /* protection violation, page was present */
+#define PF_W 0x2 /* caused by a write */
+#define PF_U 0x4 /* caused in user mode */
+
 #define TRAP_IRQ0 32
 #define TRAP_SYSCALL 64 // system call
 
@@ -3,6 +3,7 @@
 struct stat;
 struct rtcdate;
 struct sys_info;
+struct spawn_action;
 
 // system calls
 int fork(void);
@@ -28,6 +29,14 @@ int sleep(int);
 int uptime(void);
 int sysinfo(struct sys_info *);
 int crashn(int);
+int vmtune(int, int);
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int spawn(char *, char **, struct spawn_action *, int);
+int shmcreate(int, int);
+void *shmattach(int);
+int shmdetach(void *);
+int shmremove(int);
 
 // ulib.c
 int stat(char *, struct stat *);
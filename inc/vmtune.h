@@ -0,0 +1,6 @@
+#pragma once
+
+// Knobs for the vmtune() system call.
+#define VMT_HEAPLARGE 1 // back this process' heap with 2MB pages (0 or 1)
+#define VMT_FAULTAROUND 2 // pages mapped around a fault, 0 to disable (global)
+#define VMT_ZSWAPMAX 3 // KB of compressed swap kept in memory, 0 to disable (global)
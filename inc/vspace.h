@@ -2,15 +2,21 @@
 
 #include <defs.h>
 #include <mmu.h>
-
-#define NREGIONS 3
+#include <param.h>
 
 enum {
   VR_CODE   = 0,
   VR_HEAP   = 1,
   VR_USTACK = 2,
+  VR_MMAP   = 3, // first of NMMAP regions for mmap(), unused if size is 0
 };
 
+#define NREGIONS (VR_MMAP + NMMAP)
+
+// vspacefault() results
+#define FAULT_MINOR 0 // resolved without I/O
+#define FAULT_MAJOR 1 // had to read the page in
+
 #define VPI_PRESENT  ((short) 1)
 #define VPI_WRITABLE ((short) 1)
 #define VPI_READONLY ((short) 0)
@@ -20,11 +26,23 @@ struct vpage_info {
   uint64_t ppn;   // physical page number
   short present;  // whether the page is in physical memory
   short writable; // does the page have write permissions
+  short cow;      // shared with another vspace, copy before writing
+  short around;   // mapped by fault-around, not yet seen accessed
+  short evicted;  // dropped by vspacereclaim(), not yet faulted back
+  short swapped;  // not present, but in swap entry ppn (see swap.c)
   // user defined fields
 
 };
 
-#define VPIPPAGE ((PGSIZE/sizeof(struct vpage_info)) - 1)
+// A vregion's vpage_infos live in a radix tree indexed by the page's
+// number within the region. Leaves (vpi_page) hold VPIPPAGE infos and
+// interior nodes (vpi_node) VPINODE children, so a tree of height h
+// covers VPIPPAGE * VPINODE^h pages. Subtrees without any info in use
+// are not allocated.
+#define VPI_LEAFSHIFT 6
+#define VPI_NODESHIFT 6
+#define VPIPPAGE (1 << VPI_LEAFSHIFT)
+#define VPINODE (1 << VPI_NODESHIFT)
 #define VRTOP(r) \
   ((r)->dir == VRDIR_UP ? (r)->va_base + (r)->size : (r)->va_base)
 #define VRBOT(r) \
@@ -32,9 +50,25 @@ struct vpage_info {
 
 struct vpi_page {
   struct vpage_info infos[VPIPPAGE];  // info struct for the given page
-  struct vpi_page *next;              // the next page
 };
 
+struct vpi_node {
+  void *child[VPINODE];  // vpi_nodes, or vpi_pages one level above leaves
+};
+
+// A file-backed part of a vregion: pages in [va, va + memsz) are
+// filled in on first touch with the filesz bytes at offset off of the
+// region's inode, followed by zeroes.
+struct vrseg {
+  uint64_t va;     // page aligned
+  uint64_t memsz;
+  uint off;
+  uint filesz;
+  short writable;
+};
+
+#define NVRSEG 4 // file-backed segments per vregion
+
 enum vr_direction {
   VRDIR_UP,   // The code and heap "grow up"
   VRDIR_DOWN  // The stack "grows down"
@@ -44,11 +78,22 @@ struct vregion {
   enum vr_direction dir;  // direction of growth
   uint64_t va_base;       // base of the region
   uint64_t size;          // size of region in bytes
-  struct vpi_page *pages;  // pointer to array of page_infos
+  void *pages;            // root of the vpage_info tree
+  short height;           // levels of vpi_nodes above the leaves
+  short large;            // back aligned 2MB ranges with 2MB pages
+  struct inode *ip;       // file backing seg[], or 0
+  struct shm *shm;        // shared memory segment mapped here, or 0
+  short shared;           // pages are shared, not copy-on-write, by fork()
+  short nseg;             // number of segments in use
+  struct vrseg seg[NVRSEG];
 };
 
 struct vspace {
   struct vregion regions[NREGIONS]; // the regions for a process' virtual space
   pml4e_t* pgtbl;                   // process' page table
+  ushort pcid;                      // TLB tag, valid on pcidcpu only
+  struct cpu *pcidcpu;              // cpu that handed out pcid, or 0
+  uint pcidgen;                     // ... and its generation at the time
+  short tlbstale;                   // PTEs changed while not installed
 };
 
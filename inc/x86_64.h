@@ -112,6 +112,33 @@ static inline void lcr3(uint64_t val) {
   asm volatile("mov %0,%%cr3" : : "r"(val));
 }
 
+static inline uint64_t rcr3(void) {
+  uint64_t val;
+  asm volatile("mov %%cr3,%0" : "=r"(val));
+  return val;
+}
+
+static inline void lcr4(uint64_t val) {
+  asm volatile("mov %0,%%cr4" : : "r"(val));
+}
+
+static inline uint64_t rcr4(void) {
+  uint64_t val;
+  asm volatile("mov %%cr4,%0" : "=r"(val));
+  return val;
+}
+
+static inline void invlpg(void *addr) {
+  asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return lo | ((uint64_t)hi << 32);
+}
+
 static inline uint64_t rdmsr(uint32_t msr) {
   uint32_t lo, hi;
 
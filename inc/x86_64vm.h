@@ -2,10 +2,13 @@
 #include <mmu.h>
 
 void      seginit(void);
+pml4e_t*  setupkpml4(void);
 pml4e_t*  setupkvm(void);
 int       mappages(pml4e_t *, uint64_t, int, uint64_t, int, int);
+int       mappages_large(pml4e_t *, uint64_t, int, uint64_t, int, int);
+int       maplarge(pml4e_t *, uint64_t, uint64_t, int);
 pte_t*		walkpml4(pml4e_t*, const void*, int);
+int       islargemapped(pml4e_t*, const void*);
 int       allocuvm(pml4e_t*, char*, uint64_t, uint64_t);
-int       deallocuvm(pml4e_t*, char*, uint64_t, uint64_t);
 void      freevm_pdpt(pdpte_t *pdpt);
 void      freevm(pml4e_t*);
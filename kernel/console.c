@@ -223,7 +223,7 @@ struct {
 #define C(x) ((x) - '@') // Control-x
 
 void consoleintr(int (*getc)(void)) {
-  int c, doprocdump = 0;
+  int c, doprocdump = 0, dokmemdump = 0;
 
   acquire(&cons.lock);
   while ((c = getc()) >= 0) {
@@ -232,6 +232,9 @@ void consoleintr(int (*getc)(void)) {
       // procdump() locks cons.lock indirectly; invoke later
       doprocdump = 1;
       break;
+    case C('K'): // Kernel object cache listing.
+      dokmemdump = 1;
+      break;
     case C('U'): // Kill line.
       while (input.e != input.w &&
              input.buf[(input.e - 1) % INPUT_BUF] != '\n') {
@@ -263,6 +266,9 @@ void consoleintr(int (*getc)(void)) {
   if (doprocdump) {
     procdump(); // now call procdump() wo. cons.lock held
   }
+  if (dokmemdump) {
+    kmemdump();
+  }
 }
 
 int consoleread(struct inode *ip, char *dst, int n) {
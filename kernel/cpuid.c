@@ -1,3 +1,4 @@
+#include <cdefs.h>
 #include <cpuid.h>
 #include <defs.h>
 #include <x86_64.h>
@@ -122,12 +123,21 @@ static void print_feature(uint32_t *feature) {
   }
 }
 
+// features of the boot cpu, filled in by cpuid_print()
+static uint32_t feature[CPUID_NR_FLAGS];
+
 static bool cpuid_has(uint32_t *feature, unsigned int bit) {
   return feature[bit / 32] & BIT32(bit % 32);
 }
 
+// Tests whether the cpu has the feature bit, one of the
+// CPUID_FEATURE_ constants. Valid after cpuid_print().
+bool cpu_has(unsigned int bit) {
+  return cpuid_has(feature, bit);
+}
+
 void cpuid_print(void) {
-  uint32_t eax, brand[12], feature[CPUID_NR_FLAGS] = {0};
+  uint32_t eax, brand[12];
 
   cpuid(0x80000000, &eax, NULL, NULL, NULL);
   if (eax < 0x80000004)
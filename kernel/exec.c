@@ -8,7 +8,94 @@
 #include <trap.h>
 #include <x86_64.h>
 
+// Builds the address space of the program at path, with arguments
+// argv, in vs, which vspaceinit() has just set up, and points the trap
+// frame of p at its first instruction. The program's code is not read
+// in here; vspaceloadcode() only records where it lives in the file,
+// and its pages are faulted in as it runs. argv must already be in
+// kernel-accessible memory.
+//
+// returns 0, or -1 if the program cannot be loaded, in which case the
+// trap frame is left alone and vs still has to be freed
+int execload(struct proc *p, struct vspace *vs, char *path, char **argv) {
+  uint64_t rip, sp, ustack[MAXARG + 1];
+  char *s, *last;
+  int argc, len;
+
+  if (vspaceloadcode(vs, path, &rip) < 0 ||
+      vspaceinitstack(vs, SZ_2G) < 0)
+    return -1;
+
+  // copy the argument strings, then the argv array, onto the stack;
+  // they have to fit in the one page vspaceinitstack() maps
+  sp = SZ_2G;
+  for (argc = 0; argv[argc]; argc++) {
+    if (argc >= MAXARG)
+      return -1;
+    len = strlen(argv[argc]) + 1;
+    if (len > sp - (SZ_2G - PGSIZE))
+      return -1;
+    sp = (sp - len) & ~7;
+    if (vspacewritetova(vs, sp, argv[argc], len) < 0)
+      return -1;
+    ustack[argc] = sp;
+  }
+  ustack[argc] = 0;
+  if ((argc + 1) * sizeof(uint64_t) > sp - (SZ_2G - PGSIZE))
+    return -1;
+  sp -= (argc + 1) * sizeof(uint64_t);
+  if (vspacewritetova(vs, sp, (char *)ustack,
+                      (argc + 1) * sizeof(uint64_t)) < 0)
+    return -1;
+
+  // name the process after the program, for debugging
+  for (last = s = path; *s; s++)
+    if (*s == '/')
+      last = s + 1;
+  safestrcpy(p->name, last, sizeof(p->name));
+
+  p->tf->rdi = argc;
+  p->tf->rsi = sp;
+  p->tf->rsp = sp - sizeof(uint64_t); // fake return address
+  p->tf->rip = rip;
+  return 0;
+}
+
+// Replaces the program of the current process with the one at path.
+// argv is still read from after the new address space has been built.
+// The new vspace is built in kmalloc()ed memory: a struct vspace is
+// too big for the kernel stack.
+//
+// returns -1 if the program cannot be loaded, otherwise sets up the
+// trap frame to start the program and returns 0
 int exec(char *path, char **argv) {
-  // your code here
+  struct proc *p = myproc();
+  struct vspace *vs;
+  uint64_t start;
+
+  start = rdtsc();
+  if (!(vs = kmalloc(sizeof(struct vspace))))
+    return -1;
+  if (vspaceinit(vs) < 0) {
+    kfree(vs);
+    return -1;
+  }
+  if (execload(p, vs, path, argv) < 0)
+    goto bad;
+
+  // the old vspace may only go once the cpu stops using it
+  vspaceinstallkern();
+  vspacefree(&p->vspace);
+  memmove(&p->vspace, vs, sizeof(struct vspace));
+  kfree(vs);
+  vspaceinstall(p);
+
+  // trap() finishes the measurement once the first page is faulted in
+  p->exectsc = start;
+  return 0;
+
+bad:
+  vspacefree(vs);
+  kfree(vs);
   return -1;
 }
@@ -13,6 +13,8 @@
 #include <param.h>
 #include <proc.h>
 #include <sleeplock.h>
+#include <slab.h>
+#include <spawn.h>
 #include <spinlock.h>
 #include <stat.h>
 
@@ -21,6 +23,18 @@ struct devsw devsw[NDEV];
 static struct file_info file_table[NFILE];
 struct spinlock file_table_lock;
 
+static struct kmem_cache *pipe_cache;
+
+static void pipe_ctor(void *p) {
+  initlock(&((struct pipe *)p)->lock, "pipelock");
+}
+
+void fileinit(void) {
+  initlock(&file_table_lock, "ftable");
+  pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), pipe_ctor);
+  assertm(pipe_cache, "fileinit: no pipe cache");
+}
+
 int file_stat(int fd, struct stat *stat_ptr) {
   struct proc *my_proc = (struct proc *)myproc();
   acquire(&file_table_lock);
@@ -156,15 +170,21 @@ int file_read(int fd, char *buf, int nr_bytes) {
   if(fi->isPipe) {
     return pipe_read(fd, buf, nr_bytes);
   }
-  int offset = concurrent_readi(fi->node, buf, fi->offset, nr_bytes);
+  int offset;
+  if (fi->node->type == T_DEV)
+    offset = concurrent_readi(fi->node, buf, fi->offset, nr_bytes);
+  else
+    offset = pagecache_read(fi->node, buf, fi->offset, nr_bytes);
   acquire(&file_table_lock);
   my_proc->files[fd]->offset += offset;
   release(&file_table_lock);
   return offset;
 }
 
-int file_close(int fd) {
-  struct file_info *file = myproc()->files[fd];
+// Closes descriptor fd of p, which is either the current process or
+// a child that spawn() has not started yet.
+static int fdclose(struct proc *p, int fd) {
+  struct file_info *file = p->files[fd];
   if (file == NULL) {
     // no open file at this descriptor
     return -1;
@@ -177,7 +197,7 @@ int file_close(int fd) {
       if(--file->pipe->read_count == 0) {
         if(file->pipe->write_count == 0) {
           release(&file->pipe->lock);
-          kfree((char *)file->pipe);
+          kmem_cache_free(pipe_cache, file->pipe);
         } else {
           wakeup(&file->pipe->notFull);
           release(&file->pipe->lock);
@@ -192,7 +212,7 @@ int file_close(int fd) {
       if(--file->pipe->write_count == 0) {
         if(file->pipe->read_count == 0) {
           release(&file->pipe->lock);
-          kfree((char *)file->pipe);
+          kmem_cache_free(pipe_cache, file->pipe);
         } else {
           wakeup(&file->pipe->notEmpty);
           release(&file->pipe->lock);
@@ -208,7 +228,7 @@ int file_close(int fd) {
       release(&file->pipe->lock);
     }
     release(&file_table_lock);
-    myproc()->files[fd] = NULL;
+    p->files[fd] = NULL;
     return 0;
   }
   if (file->ref_count > 1)
@@ -227,10 +247,90 @@ int file_close(int fd) {
     file_table[gfd].gfd = 0;
   }
   release(&file_table_lock);
-  myproc()->files[fd] = NULL;
+  p->files[fd] = NULL;
   return 0;
 }
 
+int file_close(int fd) {
+  return fdclose(myproc(), fd);
+}
+
+// Takes another reference to file, for a second descriptor.
+static void file_ref(struct file_info *file) {
+  if (file->isPipe) {
+    if (file->pipe == NULL)
+      return;
+    acquire(&file->pipe->lock);
+    if (file->mode == O_RDONLY)
+      file->pipe->read_count++;
+    else
+      file->pipe->write_count++;
+    release(&file->pipe->lock);
+    return;
+  }
+  acquire(&file_table_lock);
+  file->ref_count++;
+  release(&file_table_lock);
+}
+
+// Gives np, a child that has not run yet, a copy of every descriptor
+// of p.
+void file_copyfds(struct proc *np, struct proc *p) {
+  for (int fd = 0; fd < NOFILE; fd++) {
+    if (p->files[fd] == NULL)
+      continue;
+    np->files[fd] = p->files[fd];
+    file_ref(np->files[fd]);
+  }
+}
+
+// Closes every descriptor of p.
+void file_closeall(struct proc *p) {
+  for (int fd = 0; fd < NOFILE; fd++) {
+    if (p->files[fd] != NULL)
+      fdclose(p, fd);
+  }
+}
+
+// Applies the spawn() file action act to the descriptors of np, a
+// child that has not run yet. A file is opened in the current process
+// and then moved over to np.
+// Returns 0 on success, -1 otherwise.
+int file_spawnact(struct proc *np, struct spawn_action *act) {
+  struct proc *my_proc = myproc();
+  int fd;
+
+  if (act->fd < 0 || act->fd >= NOFILE)
+    return -1;
+
+  switch (act->op) {
+  case SPAWN_OPEN:
+    if ((fd = file_open(act->mode, act->path)) < 0)
+      return -1;
+    if (np->files[act->fd] != NULL)
+      fdclose(np, act->fd);
+    np->files[act->fd] = my_proc->files[fd];
+    my_proc->files[fd] = NULL;
+    return 0;
+
+  case SPAWN_DUP2:
+    if (act->newfd < 0 || act->newfd >= NOFILE ||
+        np->files[act->fd] == NULL)
+      return -1;
+    if (act->newfd == act->fd)
+      return 0;
+    if (np->files[act->newfd] != NULL)
+      fdclose(np, act->newfd);
+    np->files[act->newfd] = np->files[act->fd];
+    file_ref(np->files[act->newfd]);
+    return 0;
+
+  case SPAWN_CLOSE:
+    return fdclose(np, act->fd);
+  }
+  return -1;
+}
+
 int file_open(int file_mode, char *file_path) {
   struct proc *my_proc = (struct proc *)myproc();
 
@@ -283,14 +383,13 @@ int file_open(int file_mode, char *file_path) {
 
 int pipe(int *fd_arr) {
   struct pipe *pipe;
-  if((pipe = (struct pipe *)kalloc()) == 0) {
+  if((pipe = kmem_cache_alloc(pipe_cache)) == 0) {
       return -1;
   }
   pipe->read_count = 1;
   pipe->write_count = 1;
   pipe->read_offset = 0;
   pipe->write_offset = 0;
-  initlock(&pipe->lock, "pipelock");
   
   int j = 0;
   for (int i = 0; i < NOFILE; i++) {
@@ -171,6 +171,7 @@ void iinit(int dev) {
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d bmap start %d inodestart %d\n", sb.size,
           sb.nblocks, sb.bmapstart, sb.inodestart);
+  swapinit(dev, &sb);
 
   init_inodefile(dev);
 }
@@ -67,30 +67,52 @@ void ideinit(void) {
   outb(0x1f6, 0xe0 | (0 << 4));
 }
 
+// Returns where the next sector of the multi-block request b goes in
+// memory.
+static void *idesect(struct buf *b) {
+  uint off = b->nsect * SECTOR_SIZE;
+
+  return b->pages[off / PGSIZE] + off % PGSIZE;
+}
+
 // Start the request for b.  Caller must hold idelock.
+// A multi-block request (b->nblocks != 0) moves one sector per
+// interrupt, see ideintr().
 static void idestart(struct buf *b) {
   if (b == 0)
     panic("idestart");
-  if (b->blockno >= FSSIZE)
+  if (b->blockno + max(b->nblocks, 1u) > FSSIZE)
     panic("incorrect blockno");
   int sector_per_block = BSIZE / SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
+  int nsect = sector_per_block;
   int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ : IDE_CMD_RDMUL;
   int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
   if (sector_per_block > 7)
     panic("idestart");
+  if (b->nblocks) {
+    nsect = b->nblocks * sector_per_block;
+    if (nsect > 255)
+      panic("idestart: too many blocks");
+    read_cmd = IDE_CMD_READ;
+    write_cmd = IDE_CMD_WRITE;
+    b->nsect = 0;
+  }
 
   idewait(0);
   outb(0x3f6, 0);                // generate interrupt
-  outb(0x1f2, sector_per_block); // number of sectors
+  outb(0x1f2, nsect);            // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
   if (b->flags & B_DIRTY) {
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE / 4);
+    if (b->nblocks)
+      outsl(0x1f0, idesect(b), SECTOR_SIZE / 4);
+    else
+      outsl(0x1f0, b->data, BSIZE / 4);
   } else {
     outb(0x1f7, read_cmd);
   }
@@ -107,11 +129,24 @@ void ideintr(void) {
     // cprintf("spurious IDE interrupt\n");
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
+  if (b->nblocks) {
+    // One sector of a multi-block request is done; move the next.
+    if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
+      insl(0x1f0, idesect(b), SECTOR_SIZE / 4);
+    if (++b->nsect < b->nblocks * (BSIZE / SECTOR_SIZE)) {
+      if (b->flags & B_DIRTY) {
+        idewait(0);
+        outsl(0x1f0, idesect(b), SECTOR_SIZE / 4);
+      }
+      release(&idelock);
+      return;
+    }
+  } else if (!(b->flags & B_DIRTY) && idewait(1) >= 0) {
+    // Read data if needed.
     insl(0x1f0, b->data, BSIZE / 4);
+  }
+  idequeue = b->qnext;
 
   // Wake process waiting for this buf.
   b->flags |= B_VALID;
@@ -8,7 +8,10 @@
 #include <memlayout.h>
 #include <mmu.h>
 #include <param.h>
+#include <proc.h>
+#include <slab.h>
 #include <spinlock.h>
+#include <x86_64.h>
 
 int npages = 0;
 int pages_in_use;
@@ -33,99 +36,390 @@ uint64_t page2pa(struct core_map_entry *pp) {
 // Detect machine's physical memory setup.
 // --------------------------------------------------------------
 
+// Sizes core_map to cover every page up to the end of the highest
+// usable E820 range, holes included, and reports how much memory
+// is usable and how much is ignored: reserved ranges, and usable
+// ranges beyond what the direct map can reach.
 void detect_memory(void) {
   uint32_t i;
   struct e820_entry *e;
-  size_t mem = 0, mem_max = -KERNBASE;
+  uint64_t mem = 0, usable = 0, reserved = 0, ignored = 0;
+  uint64_t end;
 
   e = e820_map.entries;
   for (i = 0; i != e820_map.nr; ++i, ++e) {
-    if (e->addr >= mem_max)
+    if (e->type != E820_AVAILABLE) {
+      reserved += e->len;
       continue;
-    mem = max(mem, (size_t)(e->addr + e->len));
+    }
+    end = min(e->addr + e->len, DMAPSIZE);
+    if (end <= e->addr) {
+      ignored += e->len;
+      continue;
+    }
+    usable += end - e->addr;
+    ignored += e->addr + e->len - end;
+    mem = max(mem, end);
   }
 
-  // Limit memory to 2GB.
-  mem = min(mem, mem_max);
   npages = mem / PGSIZE;
-  cprintf("E820: physical memory %dMB\n", mem / 1024 / 1024);
+  cprintf("E820: physical memory %dMB, %dMB usable, %dMB reserved, "
+          "%dMB ignored\n",
+          (int)(mem >> 20), (int)(usable >> 20), (int)(reserved >> 20),
+          (int)(ignored >> 20));
 }
 
 void freerange(void *vstart, void *vend);
-extern char end[]; // first address after kernel loaded from ELF file
-
+static void free_e820(uint64_t lo, uint64_t hi);
+
+// Free memory is managed by a binary buddy allocator over core_map.
+// A free block of 2^k pages is linked into kmem.free[k] through the
+// core_map entry of its first page, whose order field is k; every other
+// page of the block has order -1. Each cpu caches up to KMAGSIZE free
+// single pages in its kmag, and only takes kmem.lock to move KMAGBATCH
+// pages to or from the buddy lists.
 struct {
   struct spinlock lock;
   int use_lock;
+  struct core_map_entry *free[KALLOC_NORDER]; // free blocks of each order
+  int nfree[KALLOC_NORDER];                   // length of each free list
 } kmem;
 
-static void setrand(unsigned int);
+// Pool of free pages that have already been zeroed, filled by
+// kzero_idle() when a cpu has nothing to run and drained by
+// kalloc_zeroed(). Pages in the pool still count as free, and
+// kalloc() falls back on them once the buddy lists are empty.
+struct {
+  struct spinlock lock;
+  char *pages[KZEROPOOL];
+  int count;
+  uint hits;   // kalloc_zeroed() calls served from the pool
+  uint misses; // kalloc_zeroed() calls that had to zero a page
+} kzero;
+
+// Fills freed memory with junk to catch dangling references.
+// Only done in debug builds (`make KALLOC_DEBUG=1`): it costs a write
+// of every freed page, and at boot, of all of physical memory.
+static inline void kjunk(void *v, uint n) {
+#ifdef KALLOC_DEBUG
+  memset(v, 2, n);
+#endif
+}
+
+// first physical address handed to the page allocator
+static uint64_t kmem_start;
 
 // Initialization happens in two phases.
-// 1. main() calls kinit1() while still using entrypgdir to place just
-// the pages mapped by entrypgdir on free list.
-// 2. main() calls kinit2() with the rest of the physical pages
-// after installing a full page table that maps them on all cores.
+// 1. main() calls mem_init() while still on the boot page table,
+// which maps only the first BOOTMAPSIZE bytes of the direct map.
+// core_map is placed right after the kernel and the usable pages
+// below BOOTMAPSIZE are freed. core_map has to fit in the boot
+// mapping too, which limits memory to about BOOTMAPSIZE /
+// sizeof(struct core_map_entry) pages (some 80GB); memory beyond
+// that is left out.
+// 2. main() calls mem_init_late() after installing kpml4, which
+// maps all of physical memory, to free the rest.
 void mem_init(void *vstart) {
-  void *vend;
-
-  core_map = vstart;
-  memset(vstart, 0, PGROUNDUP(npages * sizeof(struct core_map_entry)));
-  vstart += PGROUNDUP(npages * sizeof(struct core_map_entry));
+  uint64_t cmstart, cmsize;
+  int maxpages;
+
+  cmstart = PGROUNDUP(V2P(vstart));
+  if (cmstart + PGSIZE > BOOTMAPSIZE)
+    panic("mem_init: kernel does not fit in the boot mapping");
+  maxpages = (BOOTMAPSIZE - cmstart) / sizeof(struct core_map_entry);
+  if (npages > maxpages) {
+    cprintf("mem_init: core_map only fits in the boot mapping for %dMB, "
+            "ignoring the %dMB above\n", (int)((uint64_t)maxpages >> 8),
+            (int)((uint64_t)(npages - maxpages) >> 8));
+    npages = maxpages;
+  }
+  cmsize = PGROUNDUP(npages * sizeof(struct core_map_entry));
+  kmem_start = cmstart + cmsize;
+  core_map = P2V(cmstart);
+  memset(core_map, 0, cmsize);
 
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
+  initlock(&kzero.lock, "kzero");
 
-  vend = (void *)P2V((uint64_t)(npages * PGSIZE));
-  freerange(vstart, vend);
-  free_pages = (vend - vstart) >> PT_SHIFT;
+  free_pages = 0;
   pages_in_use = 0;
   pages_in_swap = 0;
+  free_e820(kmem_start, BOOTMAPSIZE);
   kmem.use_lock = 1;
-  setrand(1);
 }
 
+void mem_init_late(void) {
+  free_e820(max(kmem_start, BOOTMAPSIZE), (uint64_t)npages * PGSIZE);
+}
+
+// Frees the pages of every usable E820 range that lie within [lo, hi).
+static void free_e820(uint64_t lo, uint64_t hi) {
+  uint64_t start, end;
+  struct e820_entry *e;
+  uint32_t i;
+
+  e = e820_map.entries;
+  for (i = 0; i != e820_map.nr; ++i, ++e) {
+    if (e->type != E820_AVAILABLE)
+      continue;
+    start = PGROUNDUP(max(e->addr, lo));
+    end = min(e->addr + e->len, hi) & ~(PGSIZE - 1);
+    if (start < end)
+      freerange(P2V(start), P2V(end));
+  }
+}
+
+static void buddy_free(struct core_map_entry *, int);
+
+// Hands [vstart, vend) to the buddy allocator in the largest
+// naturally aligned blocks that fit. Only core_map is written;
+// the pages themselves are not touched unless KALLOC_DEBUG is set.
 void freerange(void *vstart, void *vend) {
-  char *p;
-  p = (char *)PGROUNDUP((uint64_t)vstart);
-  for (; p + PGSIZE <= (char *)vend; p += PGSIZE)
-    kfree(p);
+  uint64_t i, n, end;
+  int order;
+
+  i = PGNUM(V2P(PGROUNDUP((uint64_t)vstart)));
+  end = PGNUM(V2P(vend));
+  while (i < end) {
+    for (order = KALLOC_NORDER - 1; order > 0; order--)
+      if (i % (1 << order) == 0 && i + (1 << order) <= end)
+        break;
+
+    kjunk(P2V(i << PT_SHIFT), PGSIZE << order);
+    for (n = 0; n < (1 << order); n++) {
+      core_map[i + n].available = 1;
+      core_map[i + n].order = -1;
+    }
+    if (kmem.use_lock)
+      acquire(&kmem.lock);
+    buddy_free(&core_map[i], order);
+    if (kmem.use_lock)
+      release(&kmem.lock);
+    free_pages += 1 << order;
+    i += 1 << order;
+  }
+}
+
+// Pushes the free block headed by r onto kmem.free[order].
+// Caller must hold kmem.lock.
+static void buddy_push(struct core_map_entry *r, int order) {
+  r->order = order;
+  r->prev = NULL;
+  r->next = kmem.free[order];
+  if (r->next)
+    r->next->prev = r;
+  kmem.free[order] = r;
+  kmem.nfree[order]++;
+}
+
+// Unlinks the free block headed by r from its free list.
+// Caller must hold kmem.lock.
+static void buddy_remove(struct core_map_entry *r) {
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free[r->order] = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  kmem.nfree[r->order]--;
+  r->next = r->prev = NULL;
+  r->order = -1;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
-void kfree(char *v) {
+// Removes a free block of 2^order pages from the free lists, splitting a
+// larger block if needed. Returns the block's first entry, or NULL.
+// Caller must hold kmem.lock.
+static struct core_map_entry *buddy_alloc(int order) {
   struct core_map_entry *r;
+  int k;
+
+  for (k = order; k < KALLOC_NORDER && !kmem.free[k]; k++)
+    ;
+  if (k == KALLOC_NORDER)
+    return NULL;
+
+  r = kmem.free[k];
+  buddy_remove(r);
+  // give the upper halves back until the block is the right size
+  while (k > order) {
+    k--;
+    buddy_push(r + (1 << k), k);
+  }
+  return r;
+}
 
-  if ((uint64_t)v % PGSIZE || v < _end || V2P(v) >= (uint64_t)(npages * PGSIZE))
-    panic("kfree");
+// Returns the block of 2^order pages starting at r to the free lists,
+// coalescing it with its buddy for as long as the buddy is free.
+// All pages of the block must already be marked available.
+// Caller must hold kmem.lock.
+static void buddy_free(struct core_map_entry *r, int order) {
+  uint64_t idx, bidx;
+  struct core_map_entry *b;
+
+  idx = r - core_map;
+  r->order = -1;
+  while (order < KALLOC_NORDER - 1) {
+    bidx = idx ^ (UINT64_C(1) << order);
+    if (bidx + (UINT64_C(1) << order) > npages)
+      break;
+    b = &core_map[bidx];
+    if (!b->available || b->order != order)
+      break;
+    buddy_remove(b);
+    idx = min(idx, bidx);
+    order++;
+  }
+  buddy_push(&core_map[idx], order);
+}
+
+// Moves up to KMAGBATCH pages from the buddy lists into m.
+// Caller must have interrupts off.
+static void kmag_refill(struct kmag *m) {
+  struct core_map_entry *r;
+  int n;
 
   if (kmem.use_lock)
     acquire(&kmem.lock);
+  for (n = 0; n < KMAGBATCH && (r = buddy_alloc(0)); n++)
+    m->pages[m->count++] = P2V(page2pa(r));
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  if (n > 0)
+    m->refills++;
+}
+
+// Takes a page from the zeroed pool, or returns 0 if it is empty.
+static char *kzero_pop(void) {
+  char *v = 0;
 
-  r = (struct core_map_entry *)pa2page(V2P(v));
+  acquire(&kzero.lock);
+  if (kzero.count > 0)
+    v = kzero.pages[--kzero.count];
+  release(&kzero.lock);
+  return v;
+}
+
+// Returns KMAGBATCH pages from m to the buddy lists.
+// Caller must have interrupts off.
+static void kmag_drain(struct kmag *m) {
+  int n;
 
-  pages_in_use--;
-  free_pages++;
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  for (n = 0; n < KMAGBATCH && m->count > 0; n++)
+    buddy_free(pa2page(V2P(m->pages[--m->count])), 0);
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  m->drains++;
+}
 
-  // Fill with junk to catch dangling refs.
-  memset(v, 2, PGSIZE);
+// Checks that v heads an allocated block of 2^order pages.
+static struct core_map_entry *kpage_check(char *v, int order) {
+  struct core_map_entry *r;
+
+  if ((uint64_t)v % (PGSIZE << order) || V2P(v) < kmem_start ||
+      V2P(v) + (PGSIZE << order) > (uint64_t)npages * PGSIZE)
+    panic("kfree");
+
+  r = pa2page(V2P(v));
+  if (r->available)
+    panic("kfree: freeing free page");
+  if (r->order != order)
+    panic("kfree: wrong order");
+  return r;
+}
+
+// Free the memory pointed at by v, which must have been
+// returned by kalloc(), kalloc_pages(0) or kmalloc().
+// Objects that live in a slab go back to their cache and
+// large kmalloc() blocks to the buddy allocator; single
+// pages go to this cpu's magazine.
+void kfree(void *v) {
+  struct core_map_entry *r;
+  struct kmag *m;
+
+  if (V2P(v) >= kmem_start && V2P(v) < (uint64_t)npages * PGSIZE) {
+    r = pa2page(V2P(v));
+    if (!r->available && r->slab) {
+      kmem_cache_free(r->slab->cache, v);
+      return;
+    }
+    if (!r->available && r->kmlarge) {
+      r->kmlarge = 0;
+      kmalloc_large_free(r->order);
+      kfree_pages(v, r->order);
+      return;
+    }
+    // other kalloc_pages() blocks go back through kfree_pages()
+    if (!r->available && r->order > 0)
+      panic("kfree: multi-page block");
+  }
+
+  r = kpage_check(v, 0);
+
+  // a page shared copy-on-write stays until its last user frees it
+  if (__sync_sub_and_fetch(&r->ref, 1) > 0)
+    return;
+
+  kjunk(v, PGSIZE);
 
   r->available = 1;
+  r->order = -1;
   r->user = 0;
   r->va = 0;
+  r->pgtbl = 0;
+
+  pushcli();
+  m = &mycpu()->kmag;
+  if (m->count == KMAGSIZE)
+    kmag_drain(m);
+  m->pages[m->count++] = v;
+  popcli();
+
+  __sync_fetch_and_sub(&pages_in_use, 1);
+  __sync_fetch_and_add(&free_pages, 1);
+}
+
+// Frees a block of 2^order physically contiguous pages
+// that was returned by kalloc_pages(order).
+void kfree_pages(char *v, int order) {
+  struct core_map_entry *r;
+  int i;
+
+  if (order == 0) {
+    kfree(v);
+    return;
+  }
+
+  r = kpage_check(v, order);
+
+  kjunk(v, PGSIZE << order);
+
+  for (i = 0; i < (1 << order); i++) {
+    r[i].available = 1;
+    r[i].user = 0;
+    r[i].va = 0;
+    r[i].pgtbl = 0;
+  }
+
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  buddy_free(r, order);
   if (kmem.use_lock)
     release(&kmem.lock);
+
+  __sync_fetch_and_sub(&pages_in_use, 1 << order);
+  __sync_fetch_and_add(&free_pages, 1 << order);
 }
 
-void mark_user_mem(uint64_t pa, uint64_t va) {
+void mark_user_mem(uint64_t pa, uint64_t va, pml4e_t *pgtbl) {
   // for user mem, add an mapping to proc_info
   struct core_map_entry *r = pa2page(pa);
 
   r->user = 1;
   r->va = va;
+  r->pgtbl = pgtbl;
 }
 
 void mark_kernel_mem(uint64_t pa) {
@@ -134,51 +428,228 @@ void mark_kernel_mem(uint64_t pa) {
 
   r->user = 0;
   r->va = 0;
+  r->pgtbl = 0;
 }
 
 char *kalloc(void) {
+  struct core_map_entry *r;
+  struct kmag *m;
+  char *v = 0;
+
+  pushcli();
+  m = &mycpu()->kmag;
+  if (m->count > 0)
+    m->hits++;
+  else
+    kmag_refill(m);
+  if (m->count > 0)
+    v = m->pages[--m->count];
+  popcli();
+
+  if (!v && !(v = kzero_pop()))
+    return 0;
+
+  r = pa2page(V2P(v));
+  r->available = 0;
+  r->ref = 1;
+  r->order = 0;
+  r->slab = NULL;
+  __sync_fetch_and_add(&pages_in_use, 1);
+  __sync_fetch_and_sub(&free_pages, 1);
+  return v;
+}
+
+// Allocates a page zeroed ahead of time by kzero_idle().
+// Returns 0 if the zeroed pool is empty.
+char *kalloc_prezeroed(void) {
+  struct core_map_entry *r;
+  char *v;
+
+  if (!(v = kzero_pop()))
+    return 0;
+  __sync_fetch_and_add(&kzero.hits, 1);
+
+  r = pa2page(V2P(v));
+  r->available = 0;
+  r->ref = 1;
+  r->order = 0;
+  r->slab = NULL;
+  __sync_fetch_and_add(&pages_in_use, 1);
+  __sync_fetch_and_sub(&free_pages, 1);
+  return v;
+}
+
+// Allocates a page whose contents are all zero, preferably
+// one zeroed ahead of time by kzero_idle().
+char *kalloc_zeroed(void) {
+  char *v;
+
+  if ((v = kalloc_prezeroed()))
+    return v;
+  __sync_fetch_and_add(&kzero.misses, 1);
+  if ((v = kalloc()))
+    memset(v, 0, PGSIZE);
+  return v;
+}
+
+// Zeroes one free page into the zeroed pool, if the pool has room.
+// Called by scheduler() when it found nothing to run, with no locks
+// held; the page is cleared outside of both locks. Returns 1 if it
+// did any work.
+int kzero_idle(void) {
+  struct core_map_entry *r;
+  char *v;
+
+  if (kzero.count >= KZEROPOOL)
+    return 0;
+
+  acquire(&kmem.lock);
+  r = buddy_alloc(0);
+  release(&kmem.lock);
+  if (!r)
+    return 0;
+
+  // the page stays available, it only moves from the buddy lists
+  // to the pool, just like a page in a magazine
+  v = P2V(page2pa(r));
+  memset(v, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  if (kzero.count < KZEROPOOL) {
+    kzero.pages[kzero.count++] = v;
+    v = 0;
+  }
+  release(&kzero.lock);
+
+  if (v) {
+    acquire(&kmem.lock);
+    buddy_free(r, 0);
+    release(&kmem.lock);
+  }
+  return 1;
+}
+
+// Zeroed pool statistics, for sysinfo.
+void kzero_stats(int *hits, int *misses, int *pooled) {
+  *hits = kzero.hits;
+  *misses = kzero.misses;
+  *pooled = kzero.count;
+}
 
+// Allocates 2^order physically contiguous pages, aligned to their size.
+// Returns 0 if no block that large is free.
+char *kalloc_pages(int order) {
+  struct core_map_entry *r;
   int i;
 
+  if (order == 0)
+    return kalloc();
+  if (order < 0 || order >= KALLOC_NORDER)
+    return 0;
+
   if (kmem.use_lock)
     acquire(&kmem.lock);
+  r = buddy_alloc(order);
+  if (kmem.use_lock)
+    release(&kmem.lock);
 
-  for (i = 0; i < npages; i++) {
-    if (core_map[i].available == 1) {
-      core_map[i].available = 0;
-      pages_in_use++;
-      free_pages--;
-      if (kmem.use_lock)
-        release(&kmem.lock);
-      return P2V(page2pa(&core_map[i]));
-    }
+  if (!r)
+    return 0;
+
+  for (i = 0; i < (1 << order); i++) {
+    r[i].available = 0;
+    r[i].ref = 1;
+    r[i].slab = NULL;
   }
+  r->order = order;
 
-  if (kmem.use_lock)
-    release(&kmem.lock);
+  __sync_fetch_and_add(&pages_in_use, 1 << order);
+  __sync_fetch_and_sub(&free_pages, 1 << order);
+  return P2V(page2pa(r));
+}
 
-  return 0;
+// Allocates 2^order physically contiguous pages, aligned to their
+// size, that are handed out as separate pages: each one is freed on
+// its own with kfree(). Returns 0 if no block that large is free.
+char *kalloc_split(int order) {
+  struct core_map_entry *r;
+  char *v;
+  int i;
+
+  if (!(v = kalloc_pages(order)))
+    return 0;
+  r = pa2page(V2P(v));
+  for (i = 0; i < (1 << order); i++)
+    r[i].order = 0;
+  return v;
+}
+
+// Number of free blocks of the given order, for sysinfo.
+int kalloc_nfree(int order) {
+  return kmem.nfree[order];
 }
 
-static unsigned long int next = 1;
+#ifdef KALLOC_BENCH
+// Average cost in cycles of a kalloc()/kfree() pair once the allocator
+// has been driven to pct percent utilisation. The pages taken to reach
+// that level are chained through their first word and returned after.
+static uint64_t kalloc_bench_at(int pct) {
+  const int rounds = 1000;
+  char *held = 0, *p;
+  uint64_t start, cycles;
+  int i;
 
-// returns random integer from [0, limit)
-static int rand(int limit) {
-  next = next * 1103515245 + 12345;
-  return (unsigned int)(next / 65536) % limit;
+  while (pages_in_use * 100 < (pages_in_use + free_pages) * pct) {
+    if (!(p = kalloc()))
+      break;
+    *(char **)p = held;
+    held = p;
+  }
+
+  start = rdtsc();
+  for (i = 0; i < rounds; i++) {
+    p = kalloc();
+    assert(p);
+    kfree(p);
+  }
+  cycles = (rdtsc() - start) / rounds;
+
+  while (held) {
+    p = held;
+    held = *(char **)p;
+    kfree(p);
+  }
+  return cycles;
 }
 
-// Sets the seed for random.
-// Intended to be used before calling rand.
-static void setrand(unsigned int seed) { next = seed; }
+// Boot-time microbenchmark of the physical page allocator.
+// Build with `make KALLOC_BENCH=1` to enable.
+void kalloc_bench(void) {
+  static int levels[] = {10, 50, 95};
+  int i;
 
-struct core_map_entry *get_random_user_page() {
-  int x = 100;
-  while (x--) {
-    int rand_index = rand(npages);
-    if (core_map[rand_index].va != 0) {
-      return &core_map[rand_index];
-    }
+  for (i = 0; i < NELEM(levels); i++)
+    cprintf("kalloc: %d%% utilisation, %d cycles per alloc/free\n",
+            levels[i], (int)kalloc_bench_at(levels[i]));
+}
+#endif
+
+static int clockhand; // next core_map entry clock_next() looks at
+
+// Moves the clock hand of page replacement on to the next page mapped
+// by a user address space, and returns it. The entry only says who
+// mapped the page last; the caller has to check that it still does.
+// The hand moves at most *steps entries, which are deducted.
+// Returns 0 if it finds no such page within them.
+struct core_map_entry *clock_next(int *steps) {
+  struct core_map_entry *r;
+
+  while (*steps > 0) {
+    (*steps)--;
+    r = &core_map[clockhand];
+    clockhand = (clockhand + 1) % npages;
+    if (!r->available && r->user && r->pgtbl)
+      return r;
   }
-  panic("Tried 100 random indices for random user page, all failed");
+  return 0;
 }
@@ -0,0 +1,149 @@
+// A small LZ77 codec in the style of LZ4, for compressing pages.
+//
+// The compressed form is a series of sequences, each a token byte
+// followed by literals and a match:
+//
+//   token: high nibble is the literal count, low nibble the match
+//          length minus LZ_MINMATCH; 15 means more length bytes follow,
+//          each adding up to 255 (a byte below 255 ends the length)
+//   literal length bytes, then the literals themselves
+//   2-byte little endian offset back to the match, then match length
+//   bytes
+//
+// The last sequence has literals only and ends the input. The
+// compressor finds matches through a hash table of the positions of
+// recently seen 4-byte strings, which the caller provides, so it keeps
+// no state of its own.
+
+#include <cdefs.h>
+#include <defs.h>
+
+#define LZ_MINMATCH 4
+#define LZ_MAXOFF 65535
+
+static inline uint lz_read32(const uchar *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+}
+
+static inline uint lz_hash(uint v) {
+  return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+// Writes the part of length len that did not fit in its nibble.
+static uchar *lz_putlen(uchar *op, uint len) {
+  for (len -= 15; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+// Appends a sequence of nlit literals from lit and, if mlen is not 0,
+// a match of mlen bytes off bytes back to the output at *op, which
+// must not go past end.
+// Returns 0, or -1 if the output does not fit.
+static int lz_putseq(uchar **op, uchar *end, const uchar *lit, uint nlit,
+                     uint off, uint mlen) {
+  uchar *p = *op;
+  uint ml = mlen ? mlen - LZ_MINMATCH : 0;
+
+  // worst case: token, length bytes, literals, offset
+  if (p + 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1 > end)
+    return -1;
+  *p++ = (min(nlit, 15u) << 4) | min(ml, 15u);
+  if (nlit >= 15)
+    p = lz_putlen(p, nlit);
+  memmove(p, lit, nlit);
+  p += nlit;
+  if (mlen) {
+    *p++ = off;
+    *p++ = off >> 8;
+    if (ml >= 15)
+      p = lz_putlen(p, ml);
+  }
+  *op = p;
+  return 0;
+}
+
+// Compresses the n bytes at src, n at most LZ_MAXOFF, into at most
+// max bytes at dst. dict is a hash table of 1 << LZ_HASHBITS entries.
+// Returns the compressed size, or -1 if it would be over max.
+int lz_compress(const uchar *src, uint n, uchar *dst, uint max,
+                ushort *dict) {
+  uchar *op = dst, *end = dst + max;
+  uint ip, anchor, cand, len, h;
+
+  assert(n <= LZ_MAXOFF);
+  memset(dict, 0, sizeof(ushort) << LZ_HASHBITS);
+  for (ip = anchor = 0; ip + LZ_MINMATCH <= n;) {
+    h = lz_hash(lz_read32(src + ip));
+    cand = dict[h];
+    dict[h] = ip;
+    if (cand >= ip || lz_read32(src + cand) != lz_read32(src + ip)) {
+      ip++;
+      continue;
+    }
+    for (len = LZ_MINMATCH; ip + len < n && src[cand + len] == src[ip + len];
+         len++)
+      ;
+    if (lz_putseq(&op, end, src + anchor, ip - anchor, ip - cand, len) < 0)
+      return -1;
+    ip += len;
+    anchor = ip;
+  }
+  if (lz_putseq(&op, end, src + anchor, n - anchor, 0, 0) < 0)
+    return -1;
+  return op - dst;
+}
+
+// Reads the rest of a length whose nibble was 15 from *ip, which must
+// not go past end.
+// Returns the length, or -1 if the input ends first.
+static int lz_getlen(const uchar **ip, const uchar *end, uint len) {
+  uint b;
+
+  do {
+    if (*ip >= end)
+      return -1;
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+// Decompresses the n bytes at src into at most max bytes at dst.
+// Returns the decompressed size, or -1 if the input is corrupt or
+// does not fit.
+int lz_decompress(const uchar *src, uint n, uchar *dst, uint max) {
+  const uchar *ip = src, *iend = src + n;
+  uchar *op = dst, *oend = dst + max, *match;
+  int nlit, mlen;
+  uint off;
+
+  while (ip < iend) {
+    uchar token = *ip++;
+
+    if ((nlit = token >> 4) == 15 && (nlit = lz_getlen(&ip, iend, 15)) < 0)
+      return -1;
+    if (nlit > iend - ip || nlit > oend - op)
+      return -1;
+    memmove(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if ((mlen = token & 15) == 15 && (mlen = lz_getlen(&ip, iend, 15)) < 0)
+      return -1;
+    mlen += LZ_MINMATCH;
+    if (off == 0 || off > op - dst || mlen > oend - op)
+      return -1;
+    // byte by byte: the match may overlap what it produces
+    for (match = op - off; mlen > 0; mlen--)
+      *op++ = *match++;
+  }
+  return op - dst;
+}
@@ -4,15 +4,24 @@
 #include <e820.h>
 #include <memlayout.h>
 #include <trap.h>
+#include <x86_64.h>
 
 noreturn static void mpmain(void);
 extern char _end[]; // first address after kernel loaded from ELF file
 
 int main(uint64_t addr) {
+  uint64_t t0, t1, t2, t3;
+
   e820_init(addr);
   detect_memory();
+  t0 = rdtsc();
   mem_init(_end); // phys page allocator
+  t1 = rdtsc();
+  kmallocinit();  // kernel heap
   vspacebootinit();
+  t2 = rdtsc();
+  mem_init_late(); // memory beyond the boot mapping
+  t3 = rdtsc();
   mpinit();
   lapicinit();
   picinit();
@@ -20,12 +29,24 @@ int main(uint64_t addr) {
   consoleinit();
   uartinit(); // serial port
   cpuid_print();
+  vspacetlbinit(); // global kernel pages, PCID-tagged user ones
   e820_print();
   cprintf("\ncpu%d: starting xk\n\n", cpunum());
   cprintf("free pages: %d\n", free_pages);
+  cprintf("mem_init: %ld cycles, mem_init_late: %ld cycles\n", t1 - t0,
+          t3 - t2);
+#ifdef KALLOC_BENCH
+  kalloc_bench();
+#endif
+#ifdef VSPACE_BENCH
+  vspacebench();
+#endif
   pinit();
   tvinit();   // trap vectors
   binit();    // buffer cache
+  pagecacheinit(); // page cache
+  shminit();       // shared memory segments
+  fileinit(); // file table
   ideinit();  // disk
   userinit(); // first user process
   mpmain();
@@ -34,6 +34,7 @@ void ideintr(void) {
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
 void iderw(struct buf *b) {
   uchar *p;
+  uint i;
 
   if (!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
@@ -41,12 +42,19 @@ void iderw(struct buf *b) {
     panic("iderw: nothing to do");
   if (b->dev != 1)
     panic("iderw: request not for disk 1");
-  if (b->blockno >= disksize)
+  if (b->blockno + max(b->nblocks, 1u) > disksize)
     panic("iderw: block out of range");
 
   p = memdisk + b->blockno * BSIZE;
 
-  if (b->flags & B_DIRTY) {
+  if (b->nblocks) {
+    for (i = 0; i < b->nblocks * BSIZE; i += PGSIZE)
+      if (b->flags & B_DIRTY)
+        memmove(p + i, b->pages[i / PGSIZE], PGSIZE);
+      else
+        memmove(b->pages[i / PGSIZE], p + i, PGSIZE);
+    b->flags &= ~B_DIRTY;
+  } else if (b->flags & B_DIRTY) {
     b->flags &= ~B_DIRTY;
     memmove(p, b->data, BSIZE);
   } else
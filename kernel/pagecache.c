@@ -0,0 +1,283 @@
+// Page cache: whole pages of file data, keyed by (device, inode number,
+// page-aligned file offset).
+//
+// A cached page is an ordinary kalloc() page. The cache holds one
+// reference on it through its core_map entry, and every vspace that
+// maps it holds another, so a page is only freed once it is both
+// evicted and unmapped. read() of a file goes through the cache too,
+// so it sees what MAP_SHARED mappings wrote to the file's pages. The
+// file system is read-only, so such writes cannot be written back:
+// they last as long as the page stays cached, which it does at least
+// while some vspace maps it, and are lost once it is evicted.
+//
+// The cache holds at most NPCACHE pages. When it is full, the least
+// recently used page that nobody maps anymore is evicted; if
+// there is none, pagecache_get() hands out the new page uncached,
+// which is fine for read() and private mappings. Shared mappings use
+// pagecache_getcached() instead, which fails then: their pages must be
+// the cache's, or their writes would be lost.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <file.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <slab.h>
+#include <spinlock.h>
+
+#define PCHASH 64
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint pgoff;               // file offset / PGSIZE
+  char *page;
+  struct pcpage *hnext;     // hash chain
+  struct pcpage *prev;      // LRU list, most recently used first
+  struct pcpage *next;
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache *cache; // struct pcpage objects
+  struct pcpage *hash[PCHASH];
+  struct pcpage *head;      // LRU list
+  struct pcpage *tail;
+  int count;
+  uint hits;                // pagecache_get() calls served from the cache
+  uint misses;              // ... that had to read the file
+} pcache;
+
+static inline uint pchash(uint dev, uint inum, uint pgoff) {
+  return (dev * 31 + inum * 17 + pgoff) % PCHASH;
+}
+
+void pagecacheinit(void) {
+  initlock(&pcache.lock, "pagecache");
+  pcache.cache = kmem_cache_create("pcpage", sizeof(struct pcpage), 0);
+  assertm(pcache.cache, "pagecacheinit: no cache");
+}
+
+// Unlinks e from the LRU list. Caller must hold pcache.lock.
+static void lru_unlink(struct pcpage *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    pcache.head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    pcache.tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+// Makes e the most recently used page. Caller must hold pcache.lock.
+static void lru_push(struct pcpage *e) {
+  e->prev = NULL;
+  e->next = pcache.head;
+  if (e->next)
+    e->next->prev = e;
+  else
+    pcache.tail = e;
+  pcache.head = e;
+}
+
+// Caller must hold pcache.lock.
+static struct pcpage *pc_lookup(uint dev, uint inum, uint pgoff) {
+  struct pcpage *e;
+
+  for (e = pcache.hash[pchash(dev, inum, pgoff)]; e; e = e->hnext)
+    if (e->dev == dev && e->inum == inum && e->pgoff == pgoff)
+      return e;
+  return 0;
+}
+
+// Removes e from the cache and drops the cache's reference to its
+// page. Caller must hold pcache.lock.
+static void pc_remove(struct pcpage *e) {
+  struct pcpage **pp;
+
+  for (pp = &pcache.hash[pchash(e->dev, e->inum, e->pgoff)]; *pp != e;
+       pp = &(*pp)->hnext)
+    ;
+  *pp = e->hnext;
+  lru_unlink(e);
+  pcache.count--;
+  kfree(e->page);
+  kmem_cache_free(pcache.cache, e);
+}
+
+// Evicts the least recently used page that only the cache refers to.
+// Returns 0 if there is none. Caller must hold pcache.lock.
+static int pc_evict(void) {
+  struct pcpage *e;
+
+  for (e = pcache.tail; e; e = e->prev)
+    if (pa2page(V2P(e->page))->ref == 1)
+      break;
+  if (!e)
+    return 0;
+  pc_remove(e);
+  return 1;
+}
+
+// Returns the page holding the PGSIZE bytes of ip at off, which must
+// be page aligned and within the file, with a reference taken for the
+// caller, who drops it with kfree(). The part of the last page past
+// the end of the file is zero. ip must not be locked by the caller.
+// If cached is set, the page must be the cache's.
+// Returns 0 if out of memory, the file cannot be read, or the page
+// cannot be cached although it must.
+static char *pc_get(struct inode *ip, uint off, int cached) {
+  struct pcpage *e;
+  char *page;
+  uint pgoff = off / PGSIZE;
+  int n;
+
+  acquire(&pcache.lock);
+  if ((e = pc_lookup(ip->dev, ip->inum, pgoff))) {
+    page = e->page;
+    __sync_fetch_and_add(&pa2page(V2P(page))->ref, 1);
+    lru_unlink(e);
+    lru_push(e);
+    pcache.hits++;
+    release(&pcache.lock);
+    return page;
+  }
+  pcache.misses++;
+  release(&pcache.lock);
+
+  if (!(page = kalloc()))
+    return 0;
+  if ((n = concurrent_readi(ip, page, off, PGSIZE)) <= 0) {
+    kfree(page);
+    return 0;
+  }
+  memset(page + n, 0, PGSIZE - n);
+
+  acquire(&pcache.lock);
+  // someone may have read the same page in while we were
+  if ((e = pc_lookup(ip->dev, ip->inum, pgoff))) {
+    __sync_fetch_and_add(&pa2page(V2P(e->page))->ref, 1);
+    kfree(page);
+    page = e->page;
+    release(&pcache.lock);
+    return page;
+  }
+  if ((pcache.count < NPCACHE || pc_evict()) &&
+      (e = kmem_cache_alloc(pcache.cache))) {
+    e->dev = ip->dev;
+    e->inum = ip->inum;
+    e->pgoff = pgoff;
+    e->page = page;
+    e->hnext = pcache.hash[pchash(e->dev, e->inum, pgoff)];
+    pcache.hash[pchash(e->dev, e->inum, pgoff)] = e;
+    lru_push(e);
+    pcache.count++;
+    // the cache's reference
+    __sync_fetch_and_add(&pa2page(V2P(page))->ref, 1);
+  } else if (cached) {
+    release(&pcache.lock);
+    kfree(page);
+    return 0;
+  }
+  release(&pcache.lock);
+  return page;
+}
+
+// Returns the page of ip at off, like pc_get(), whether the cache can
+// keep it or not.
+char *pagecache_get(struct inode *ip, uint off) {
+  return pc_get(ip, off, 0);
+}
+
+// Returns the page of ip at off, like pc_get(), but only if it is
+// the cache's, so that it stays cached while the caller holds it.
+// Returns 0 if the cache is full of pages it cannot evict.
+char *pagecache_getcached(struct inode *ip, uint off) {
+  return pc_get(ip, off, 1);
+}
+
+// Returns the cached page of ip at off with a reference taken for the
+// caller, like pagecache_get(), or 0 if it is not cached. Never reads
+// the file.
+char *pagecache_peek(struct inode *ip, uint off) {
+  struct pcpage *e;
+  char *page = 0;
+
+  acquire(&pcache.lock);
+  if ((e = pc_lookup(ip->dev, ip->inum, off / PGSIZE))) {
+    page = e->page;
+    __sync_fetch_and_add(&pa2page(V2P(page))->ref, 1);
+    lru_unlink(e);
+    lru_push(e);
+  }
+  release(&pcache.lock);
+  return page;
+}
+
+// Tests whether page is the cached page of ip at off.
+int pagecache_has(struct inode *ip, uint off, char *page) {
+  struct pcpage *e;
+  int has;
+
+  acquire(&pcache.lock);
+  has = (e = pc_lookup(ip->dev, ip->inum, off / PGSIZE)) && e->page == page;
+  release(&pcache.lock);
+  return has;
+}
+
+// Frees the cached page of ip at off if nobody else refers to it,
+// e.g. because its last mapping was just evicted.
+void pagecache_drop(struct inode *ip, uint off) {
+  struct pcpage *e;
+
+  acquire(&pcache.lock);
+  if ((e = pc_lookup(ip->dev, ip->inum, off / PGSIZE)) &&
+      pa2page(V2P(e->page))->ref == 1)
+    pc_remove(e);
+  release(&pcache.lock);
+}
+
+// Reads n bytes of ip at off into dst through the page cache. Like
+// concurrent_readi(), but not for devices.
+// Returns the number of bytes read, or -1.
+int pagecache_read(struct inode *ip, char *dst, uint off, uint n) {
+  uint tot, m, size;
+  char *page;
+
+  locki(ip);
+  size = ip->size;
+  unlocki(ip);
+
+  if (off > size || off + n < off)
+    return -1;
+  if (off + n > size)
+    n = size - off;
+
+  for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    if (!(page = pagecache_get(ip, off - off % PGSIZE)))
+      return -1;
+    m = min(n - tot, (uint)(PGSIZE - off % PGSIZE));
+    memmove(dst, page + off % PGSIZE, m);
+    kfree(page);
+  }
+  return n;
+}
+
+// Reports the number of cached pages, how many of them are mapped by
+// more than one vspace, and the cache's hit and miss counts.
+void pagecache_stats(int *pages, int *shared, int *hits, int *misses) {
+  struct pcpage *e;
+
+  acquire(&pcache.lock);
+  *pages = pcache.count;
+  *shared = 0;
+  for (e = pcache.head; e; e = e->next)
+    if (pa2page(V2P(e->page))->ref > 2)
+      (*shared)++;
+  *hits = pcache.hits;
+  *misses = pcache.misses;
+  release(&pcache.lock);
+}
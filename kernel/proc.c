@@ -7,6 +7,7 @@
 #include <param.h>
 #include <fcntl.h>
 #include <proc.h>
+#include <spawn.h>
 #include <spinlock.h>
 #include <trap.h>
 #include <vspace.h>
@@ -61,6 +62,8 @@ found:
   p->state = EMBRYO;
   p->pid = nextpid++;
   p->killed = 0;
+  p->exectsc = 0;
+  p->spawntsc = 0;
 
   release(&ptable.lock);
 
@@ -130,7 +133,17 @@ int fork(void) {
   }
   assertm(vspaceinit(&proc->vspace) == 0,
           "failed initializing virtual address space");
-  vspacecopy(&proc->vspace, &p->vspace);
+  if (vspacecopy(&proc->vspace, &p->vspace) < 0) {
+    vspaceinstall(p);
+    vspacefree(&proc->vspace);
+    kfree(proc->kstack);
+    proc->kstack = 0;
+    acquire(&ptable.lock);
+    proc->pid = 0;
+    proc->state = UNUSED;
+    release(&ptable.lock);
+    return -1;
+  }
   memmove(proc->tf, p->tf, sizeof(*proc->tf));
   acquire(&ptable.lock);
   proc->tf->rax = 0;
@@ -156,6 +169,78 @@ int fork(void) {
   return procID;
 }
 
+// Create a child of the current process running the program at path
+// with arguments argv. Unlike fork() followed by exec(), the parent's
+// address space is never copied: the child's is built straight from
+// the executable. The child starts with copies of the parent's file
+// descriptors, changed by the file actions acts[0..nact).
+// Returns the child's pid, or -1 if the program cannot be loaded or a
+// file action fails.
+int spawn(char *path, char **argv, struct spawn_action *acts, int nact) {
+  struct proc *p = myproc();
+  struct proc *np;
+  uint64_t start;
+  int i, pid;
+
+  start = rdtsc();
+  if ((np = allocproc()) == 0)
+    return -1;
+  if (vspaceinit(&np->vspace) < 0)
+    goto badproc;
+  // the segment registers and flags are the parent's
+  memmove(np->tf, p->tf, sizeof(*np->tf));
+  if (execload(np, &np->vspace, path, argv) < 0)
+    goto bad;
+
+  file_copyfds(np, p);
+  for (i = 0; i < nact; i++)
+    if (file_spawnact(np, &acts[i]) < 0)
+      goto bad;
+
+  // trap() finishes the measurement once the first page is faulted in
+  np->spawntsc = start;
+  acquire(&ptable.lock);
+  np->parent = p;
+  np->state = RUNNABLE;
+  pid = np->pid;
+  release(&ptable.lock);
+  return pid;
+
+bad:
+  file_closeall(np);
+  vspacefree(&np->vspace);
+badproc:
+  kfree(np->kstack);
+  np->kstack = 0;
+  acquire(&ptable.lock);
+  np->pid = 0;
+  np->state = UNUSED;
+  release(&ptable.lock);
+  return -1;
+}
+
+// Acquires, releases and tests ptable.lock for vspacereclaim(), which
+// holds it while it sweeps the vspaces of other processes, so that none
+// of them is freed, or starts running, under it.
+void lockptable(void) { acquire(&ptable.lock); }
+void unlockptable(void) { release(&ptable.lock); }
+int holdingptable(void) { return holding(&ptable.lock); }
+
+// Returns the vspace of the process whose page table is pgtbl, or 0
+// unless that process is runnable or sleeping: a running process may
+// be using its vspace on another cpu, and one that is still being set
+// up or has exited may be having its vspace built or freed.
+// Caller must hold ptable.lock (see lockptable()).
+struct vspace *findvspace(pml4e_t *pgtbl) {
+  struct proc *p;
+
+  assert(holding(&ptable.lock));
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if (p->vspace.pgtbl == pgtbl)
+      return p->state == RUNNABLE || p->state == SLEEPING ? &p->vspace : 0;
+  return 0;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -226,16 +311,19 @@ int wait(void) {
 //      via swtch back to the scheduler.
 void scheduler(void) {
   struct proc *p;
+  int ran;
 
   for (;;) {
     // Enable interrupts on this processor.
     sti();
 
     // Loop over process table looking for process to run.
+    ran = 0;
     acquire(&ptable.lock);
     for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
       if (p->state != RUNNABLE)
         continue;
+      ran = 1;
 
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
@@ -251,6 +339,10 @@ void scheduler(void) {
       mycpu()->proc = 0;
     }
     release(&ptable.lock);
+
+    // Nothing to run: put the idle time into zeroing free pages.
+    if (!ran)
+      kzero_idle();
   }
 }
 
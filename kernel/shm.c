@@ -0,0 +1,184 @@
+// Shared memory segments: pages that several vspaces map at once, so
+// that processes can pass data without copying it through a pipe.
+//
+// A segment is created under an integer key, by which other processes
+// find it, and is attached into the mmap() area of a vspace as a
+// region of its own. Its pages are zeroed and present from the start,
+// and fork() shares them rather than making them copy-on-write. The
+// segment holds one reference on each page through its core_map entry,
+// and every vspace that maps it holds another. The segment is freed
+// once its last attachment is gone, or, if it has none, when it is
+// removed. A removed segment can no longer be found or attached.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <spinlock.h>
+
+struct shm {
+  int used;
+  int key;
+  int npages;
+  int nattach;   // regions, in all vspaces, that map the segment
+  int removed;   // set by shmremove(), freed with the last attachment
+  char **pages;  // kmalloc()ed array of npages pages
+};
+
+static struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtable;
+
+void shminit(void) {
+  initlock(&shmtable.lock, "shm");
+}
+
+// Frees the n pages at pages, and the array itself.
+static void shmfreepages(char **pages, int n) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    kfree(pages[i]);
+  kfree(pages);
+}
+
+// Makes the slot of s free, moving the segment to *dead, whose pages
+// the caller frees once it has dropped shmtable.lock. Caller must hold
+// shmtable.lock.
+static void shmunlink(struct shm *s, struct shm *dead) {
+  *dead = *s;
+  memset(s, 0, sizeof(*s));
+}
+
+// Returns the segment with key that has not been removed, or 0.
+// Caller must hold shmtable.lock.
+static struct shm *shmfind(int key) {
+  struct shm *s;
+
+  for (s = shmtable.shm; s < &shmtable.shm[NSHM]; s++)
+    if (s->used && !s->removed && s->key == key)
+      return s;
+  return 0;
+}
+
+// Returns the id of the segment with key, creating it with room for
+// size bytes if there is none. The pages of a new segment are
+// allocated and zeroed before shmtable.lock is taken.
+// Returns -1 if size is 0 or too large, if an existing segment with
+// key is smaller than size, or if out of segments or memory.
+int shmcreate(int key, uint size) {
+  struct shm *s;
+  char **pages;
+  int id, i, npages = PGROUNDUP(size) / PGSIZE;
+
+  if (npages == 0 || npages > SHMMAXPG)
+    return -1;
+
+  acquire(&shmtable.lock);
+  s = shmfind(key);
+  id = s && s->npages >= npages ? s - shmtable.shm : -1;
+  release(&shmtable.lock);
+  if (s)
+    return id;
+
+  if (!(pages = kmalloc(npages * sizeof(char *))))
+    return -1;
+  for (i = 0; i < npages; i++) {
+    if (!(pages[i] = kalloc_zeroed())) {
+      shmfreepages(pages, i);
+      return -1;
+    }
+  }
+
+  acquire(&shmtable.lock);
+  // someone may have created the segment while we were allocating
+  if ((s = shmfind(key))) {
+    id = s->npages >= npages ? s - shmtable.shm : -1;
+  } else {
+    for (s = shmtable.shm; s < &shmtable.shm[NSHM] && s->used; s++)
+      ;
+    id = s < &shmtable.shm[NSHM] ? s - shmtable.shm : -1;
+    if (id >= 0) {
+      s->used = 1;
+      s->key = key;
+      s->npages = npages;
+      s->pages = pages;
+      pages = 0;
+    }
+  }
+  release(&shmtable.lock);
+  if (pages)
+    shmfreepages(pages, npages);
+  return id;
+}
+
+// Removes segment id: it can no longer be found or attached, and is
+// freed once it has no attachments, right away if it has none now.
+// Returns 0, or -1 if there is no segment id.
+int shmremove(int id) {
+  struct shm *s, dead = { 0 };
+
+  if (id < 0 || id >= NSHM)
+    return -1;
+  acquire(&shmtable.lock);
+  s = &shmtable.shm[id];
+  if (!s->used || s->removed) {
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->removed = 1;
+  if (s->nattach == 0)
+    shmunlink(s, &dead);
+  release(&shmtable.lock);
+  if (dead.used)
+    shmfreepages(dead.pages, dead.npages);
+  return 0;
+}
+
+// Maps segment id into the mmap() area of the current process.
+// Returns the address of the mapping, or -1 if there is no segment id
+// or no room for it.
+uint64_t shmattach(int id) {
+  struct shm *s;
+  uint64_t va;
+
+  if (id < 0 || id >= NSHM)
+    return -1;
+  acquire(&shmtable.lock);
+  s = &shmtable.shm[id];
+  if (!s->used || s->removed) {
+    release(&shmtable.lock);
+    return -1;
+  }
+  // the attachment keeps s alive while it is being mapped
+  s->nattach++;
+  release(&shmtable.lock);
+
+  if ((va = vspacemapshm(&myproc()->vspace, s, s->pages, s->npages)) == -1)
+    shmrelease(s);
+  return va;
+}
+
+// Takes another attachment of s, for a region that fork() copied.
+struct shm *shmdup(struct shm *s) {
+  acquire(&shmtable.lock);
+  s->nattach++;
+  release(&shmtable.lock);
+  return s;
+}
+
+// Drops an attachment of s, whose region has been unmapped, and frees
+// s if it was the last.
+void shmrelease(struct shm *s) {
+  struct shm dead = { 0 };
+
+  acquire(&shmtable.lock);
+  if (--s->nattach == 0)
+    shmunlink(s, &dead);
+  release(&shmtable.lock);
+  if (dead.used)
+    shmfreepages(dead.pages, dead.npages);
+}
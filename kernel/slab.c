@@ -0,0 +1,271 @@
+// Slab allocator for fixed-size kernel objects, and the
+// kmalloc() heap built on top of it.
+//
+// Each cache carves blocks of 2^order pages from the buddy allocator
+// into equally sized objects. Slabs are kept on one of three lists,
+// depending on how many of their objects are allocated, so that
+// allocation is served from a partially used slab whenever possible.
+// The core_map entry of every page in a slab points back at the slab,
+// which is how kmem_cache_free() finds the slab of an object.
+//
+// A cache may have a constructor, which is run once on every object
+// when its slab is created. Objects are expected to be freed in their
+// constructed state, so the free list link of such a cache is stored
+// past the end of the object rather than over its first bytes.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <slab.h>
+#include <spinlock.h>
+
+// slabs larger than this are not considered when sizing a cache
+#define SLAB_MAXORDER 3
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NKMEMCACHE];
+} kmem_caches;
+
+// kmalloc() size classes, one cache per power of two
+static struct {
+  struct kmem_cache *cache[KMALLOC_MAXSHIFT - KMALLOC_MINSHIFT + 1];
+  uint pages;   // pages held by allocations too large for a class
+  uint large;   // number of such allocations made
+} kheap;
+
+#define FREENEXT(c, obj) (*(char **)((obj) + (c)->freeoff))
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+// Pushes s onto the head of list.
+static void slab_push(struct slab **list, struct slab *s) {
+  s->prev = NULL;
+  s->next = *list;
+  if (s->next)
+    s->next->prev = s;
+  *list = s;
+}
+
+// Unlinks s from list.
+static void slab_unlink(struct slab **list, struct slab *s) {
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    *list = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = NULL;
+}
+
+// Creates an object cache for objects of size bytes. ctor may be NULL.
+// Returns 0 if all NKMEMCACHE caches are in use.
+struct kmem_cache *kmem_cache_create(char *name, uint size,
+                                     void (*ctor)(void *)) {
+  struct kmem_cache *c;
+  uint slotsize, waste;
+  int order;
+
+  if (kmem_caches.lock.name == 0)
+    initlock(&kmem_caches.lock, "kmem_caches");
+
+  acquire(&kmem_caches.lock);
+  for (c = kmem_caches.cache; c < &kmem_caches.cache[NKMEMCACHE]; c++)
+    if (c->name == 0)
+      goto found;
+  release(&kmem_caches.lock);
+  return 0;
+
+found:
+  memset(c, 0, sizeof(*c));
+  c->name = name;
+  release(&kmem_caches.lock);
+
+  slotsize = (max(size, (uint)sizeof(char *)) + 7) & ~7;
+  c->freeoff = 0;
+  if (ctor) {
+    c->freeoff = slotsize;
+    slotsize += sizeof(char *);
+  }
+  assertm(slotsize <= (PGSIZE << SLAB_MAXORDER) - SLABHDR,
+          "kmem_cache_create: object too large");
+
+  // use the smallest slab that wastes at most 1/8 of its space
+  for (order = 0; order < SLAB_MAXORDER; order++) {
+    waste = ((PGSIZE << order) - SLABHDR) % slotsize;
+    if (slotsize <= (PGSIZE << order) - SLABHDR &&
+        waste <= (PGSIZE << order) / 8)
+      break;
+  }
+
+  c->size = size;
+  c->slotsize = slotsize;
+  c->order = order;
+  c->perslab = ((PGSIZE << order) - SLABHDR) / slotsize;
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  return c;
+}
+
+// Allocates a new slab for c and threads its objects onto a free list.
+// Caller must hold c->lock.
+static struct slab *slab_create(struct kmem_cache *c) {
+  struct slab *s;
+  char *mem, *obj;
+  int i;
+
+  if (!(mem = kalloc_pages(c->order)))
+    return 0;
+
+  s = (struct slab *)mem;
+  s->cache = c;
+  s->inuse = 0;
+  s->freelist = 0;
+  for (i = c->perslab - 1; i >= 0; i--) {
+    obj = mem + SLABHDR + i * c->slotsize;
+    if (c->ctor)
+      c->ctor(obj);
+    FREENEXT(c, obj) = s->freelist;
+    s->freelist = obj;
+  }
+  for (i = 0; i < (1 << c->order); i++)
+    pa2page(V2P(mem) + i * PGSIZE)->slab = s;
+
+  c->nslabs++;
+  return s;
+}
+
+// Returns the pages of an empty slab to the buddy allocator.
+// Caller must hold c->lock.
+static void slab_destroy(struct kmem_cache *c, struct slab *s) {
+  int i;
+
+  for (i = 0; i < (1 << c->order); i++)
+    pa2page(V2P(s) + i * PGSIZE)->slab = NULL;
+  c->nslabs--;
+  kfree_pages((char *)s, c->order);
+}
+
+// Allocates an object from c. Returns 0 if out of memory.
+void *kmem_cache_alloc(struct kmem_cache *c) {
+  struct slab *s;
+  char *obj;
+
+  acquire(&c->lock);
+  if (!(s = c->partial)) {
+    if ((s = c->empty)) {
+      c->empty = NULL;
+    } else if (!(s = slab_create(c))) {
+      release(&c->lock);
+      return 0;
+    }
+    slab_push(&c->partial, s);
+  }
+
+  obj = s->freelist;
+  s->freelist = FREENEXT(c, obj);
+  if (++s->inuse == c->perslab) {
+    slab_unlink(&c->partial, s);
+    slab_push(&c->full, s);
+  }
+
+  c->active++;
+  c->allocs++;
+  release(&c->lock);
+  return obj;
+}
+
+// Returns obj, which must have been allocated from c, to its slab.
+void kmem_cache_free(struct kmem_cache *c, void *obj) {
+  struct slab *s;
+
+  s = pa2page(V2P(obj))->slab;
+  if (!s || s->cache != c)
+    panic("kmem_cache_free: object not from cache");
+
+  acquire(&c->lock);
+  if (s->inuse == c->perslab) {
+    slab_unlink(&c->full, s);
+    slab_push(&c->partial, s);
+  }
+
+  FREENEXT(c, (char *)obj) = s->freelist;
+  s->freelist = obj;
+  if (--s->inuse == 0) {
+    slab_unlink(&c->partial, s);
+    // keep one empty slab around to absorb alloc/free churn
+    if (c->empty)
+      slab_destroy(c, s);
+    else
+      c->empty = s;
+  }
+
+  c->active--;
+  c->frees++;
+  release(&c->lock);
+}
+
+static char *kmalloc_names[] = {
+    "kmalloc-16",  "kmalloc-32",  "kmalloc-64",   "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+// Creates the kmalloc() size class caches.
+void kmallocinit(void) {
+  int i;
+
+  static_assert(NELEM(kmalloc_names) == NELEM(kheap.cache),
+                "one name per kmalloc size class");
+  for (i = 0; i < NELEM(kheap.cache); i++) {
+    kheap.cache[i] = kmem_cache_create(kmalloc_names[i],
+                                       1 << (i + KMALLOC_MINSHIFT), 0);
+    assertm(kheap.cache[i], "kmallocinit: out of caches");
+  }
+}
+
+// Allocates size bytes of kernel memory. Requests of up to
+// 1 << KMALLOC_MAXSHIFT bytes are served from the smallest size class
+// that fits, larger ones get naturally aligned pages from the buddy
+// allocator. The result is freed with kfree(). Returns 0 on failure.
+void *kmalloc(uint size) {
+  int shift, order;
+  void *v;
+
+  for (shift = KMALLOC_MINSHIFT; shift <= KMALLOC_MAXSHIFT; shift++)
+    if (size <= (1 << shift))
+      return kmem_cache_alloc(kheap.cache[shift - KMALLOC_MINSHIFT]);
+
+  for (order = 0; order < KALLOC_NORDER; order++)
+    if (size <= (PGSIZE << order))
+      break;
+  if (order == KALLOC_NORDER || !(v = kalloc_pages(order)))
+    return 0;
+  // tells kfree() to hand the block back to kmalloc_large_free()
+  pa2page(V2P(v))->kmlarge = 1;
+  __sync_fetch_and_add(&kheap.pages, 1 << order);
+  __sync_fetch_and_add(&kheap.large, 1);
+  return v;
+}
+
+// Accounts for a large kmalloc() block being freed, called by kfree().
+void kmalloc_large_free(int order) {
+  __sync_fetch_and_sub(&kheap.pages, 1 << order);
+}
+
+// Print the statistics of every object cache to console.
+// Runs when user types ^K on console.
+void kmemdump(void) {
+  struct kmem_cache *c;
+
+  cprintf("cache            size  perslab  pages  slabs  active  allocs  frees\n");
+  for (c = kmem_caches.cache; c < &kmem_caches.cache[NKMEMCACHE]; c++) {
+    if (c->name == 0)
+      continue;
+    cprintf("%s\t\t %d\t%d\t %d\t%d\t%d\t%d\t%d\n", c->name, c->size,
+            c->perslab, 1 << c->order, c->nslabs, c->active, c->allocs,
+            c->frees);
+  }
+  cprintf("kmalloc-large: %d allocations, %d pages held\n", kheap.large,
+          kheap.pages);
+}
@@ -0,0 +1,334 @@
+// Swap: where vspacereclaim() moves anonymous pages when memory runs
+// short, and from where page faults read them back in (see
+// vregionswapin()). A page that goes out gets a swap entry, and a
+// vpage_info whose page is out holds the entry number in place of the
+// physical page number. An entry is referenced by every vpage_info
+// that holds it, as fork() shares swapped-out pages the way it shares
+// present ones, and is free once the last of them is gone.
+//
+// swapalloc() hands the pages to be written over to their entries, so
+// a fault on a page that is still on its way out copies it from memory
+// instead of reading stale data, and an entry whose page is in transit
+// is never reused.
+//
+// Where the page ends up is up to swapout(). One that compresses to at
+// most ZMAXLEN bytes (see lz.c) is kept in kernel memory, as long as
+// the compressed store stays within zswapmax KB. Only the rest are
+// given slots, in the swap area that mkfs reserves at the end of the
+// disk, behind the file system's data blocks. So the store works
+// without a swap area, and holds pages the swap area has no room for. An entry keeps its compressed page until it is freed, so
+// lowering zswapmax only turns away new pages. A page for which there
+// is neither room in the store nor a free slot stays with its entry,
+// uncompressed.
+//
+// Pages are read and written in runs of up to SWAPCLUSTER, with a
+// single disk request per run of neighbouring entries in neighbouring
+// slots.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <fs.h>
+#include <mmu.h>
+#include <param.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+
+#include <buf.h>
+
+#define BPP (PGSIZE / BSIZE)           // blocks per slot
+#define NSWAPSLOT (SWAPBLOCKS / BPP)
+#define NSWAPENT 8192                  // swap entries, wherever their pages are
+#define ZMAXLEN (1 << KMALLOC_MAXSHIFT) // largest compressed page kept
+#define ZDICTSIZE (sizeof(ushort) << LZ_HASHBITS) // lz_compress() work area
+
+int swap_outs;  // pages written out to swap
+int swap_ins;   // pages read back in by the faults that needed them
+int swap_ahead; // ... and by reading ahead of them
+int swap_ios;   // disk requests for all of those
+
+int zswapmax = ZSWAPMAX; // KB of compressed pages kept, see vmtune()
+int zswap_pages;         // pages in the compressed store
+int zswap_bytes;         // ... and their compressed size
+int zswap_hits;          // pages read back from the store
+int zswap_misses;        // ... and from the disk
+
+struct swapent {
+  uchar ref;    // vpage_infos holding the entry
+  uchar busy;   // swapout() has yet to finish with the page
+  ushort zlen;  // length of zdata
+  int slot;     // slot in the swap area holding the page, or -1
+  char *page;   // page in transit, or kept as it had nowhere to go, or 0
+  char *zdata;  // kmalloc()ed compressed page, or 0
+};
+
+static struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;                // first block of the swap area
+  int nslot;                 // 0 if there is no swap area
+  int hand;                  // where to look for free entries next
+  int slothand;              // ... and for free slots
+  struct swapent ent[NSWAPENT];
+  uchar slotused[NSWAPSLOT];
+  struct buf req;            // disk request, in use while req.lock is held
+} swap;
+
+// Sets up the swap area that sb describes. Called once the super
+// block has been read.
+void swapinit(uint dev, struct superblock *sb) {
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.req.lock, "swapio");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = min(sb->nswap / BPP, (uint)NSWAPSLOT);
+  cprintf("swap: %d slots at block %d\n", swap.nslot, swap.start);
+}
+
+// Moves the n pages at pages to or from the slots from slot on, with
+// one disk request. Requests go through swap.req one at a time; sleeps
+// until it is free and the request is done.
+static void swaprw(uint slot, char **pages, int n, int write) {
+  struct buf *b = &swap.req;
+
+  acquiresleep(&b->lock);
+  b->dev = swap.dev;
+  b->blockno = swap.start + slot * BPP;
+  b->nblocks = n * BPP;
+  b->pages = pages;
+  b->flags = write ? B_DIRTY : 0;
+  iderw(b);
+  releasesleep(&b->lock);
+  __sync_fetch_and_add(&swap_ios, 1);
+}
+
+// Allocates a run of up to n free entries, the first of the pages at
+// pages going to the first entry, and so on. The entries hold on to
+// the pages until swapout() has put them away. *got is set to the
+// length of the run.
+// Returns the first entry of the run, or -1 if there is none free, or
+// nowhere to put pages.
+int swapalloc(char **pages, int n, int *got) {
+  struct swapent *e;
+  int s, i, k;
+
+  acquire(&swap.lock);
+  if (swap.nslot == 0 && zswapmax == 0) {
+    release(&swap.lock);
+    return -1;
+  }
+  for (k = 0; k < NSWAPENT; k++) {
+    s = (swap.hand + k) % NSWAPENT;
+    if (swap.ent[s].ref == 0 && !swap.ent[s].busy)
+      break;
+  }
+  if (k == NSWAPENT) {
+    release(&swap.lock);
+    return -1;
+  }
+  for (i = 0; i < n && s + i < NSWAPENT; i++) {
+    e = &swap.ent[s + i];
+    if (e->ref != 0 || e->busy)
+      break;
+    e->ref = 1;
+    e->busy = 1;
+    e->slot = -1;
+    e->page = pages[i];
+  }
+  swap.hand = (s + i) % NSWAPENT;
+  pages_in_swap += i;
+  release(&swap.lock);
+  *got = i;
+  return s;
+}
+
+// Returns a free slot in the swap area, taking it, or -1 if there is
+// none. Caller must hold swap.lock.
+static int slotalloc(void) {
+  int s, k;
+
+  for (k = 0; k < swap.nslot; k++) {
+    s = (swap.slothand + k) % swap.nslot;
+    if (!swap.slotused[s]) {
+      swap.slotused[s] = 1;
+      swap.slothand = (s + 1) % swap.nslot;
+      return s;
+    }
+  }
+  return -1;
+}
+
+// Frees what e holds, once its last reference is gone and swapout()
+// is done with it. Caller must hold swap.lock.
+static void entfree(struct swapent *e) {
+  if (e->zdata) {
+    kfree(e->zdata);
+    zswap_pages--;
+    zswap_bytes -= e->zlen;
+  }
+  if (e->slot >= 0)
+    swap.slotused[e->slot] = 0;
+  if (e->page)
+    kfree(e->page);
+  e->zdata = 0;
+  e->slot = -1;
+  e->page = 0;
+}
+
+// Compresses page into a kmalloc()ed copy, using dict and out as work
+// areas.
+// Returns the copy, with its length in *len, or 0 if page compresses
+// to more than ZMAXLEN bytes or memory ran out.
+static char *zcompress(char *page, ushort *dict, uchar *out, int *len) {
+  char *z;
+
+  *len = lz_compress((uchar *)page, PGSIZE, out, ZMAXLEN, dict);
+  if (*len < 0 || !(z = kmalloc(*len)))
+    return 0;
+  memmove(z, out, *len);
+  return z;
+}
+
+// Puts away the n pages that swapalloc() handed to the entries from
+// ent on, and frees them. Each is compressed first, outside swap.lock,
+// which is only taken to publish the result: the pages that the
+// compressed store keeps are not written, the others are given slots
+// and the runs of them each take one disk request.
+void swapout(uint ent, int n) {
+  struct swapent *e;
+  char *pages[SWAPCLUSTER], *z[SWAPCLUSTER];
+  int len[SWAPCLUSTER], i, j;
+  ushort *dict = 0;
+  uchar *out = 0;
+
+  assert(n <= SWAPCLUSTER);
+  for (i = 0; i < n; i++) {
+    pages[i] = swap.ent[ent + i].page;
+    z[i] = 0;
+  }
+  if (zswapmax > 0 && (dict = kmalloc(ZDICTSIZE)) && (out = kmalloc(ZMAXLEN)))
+    for (i = 0; i < n; i++)
+      z[i] = zcompress(pages[i], dict, out, &len[i]);
+  if (dict)
+    kfree((char *)dict);
+  if (out)
+    kfree((char *)out);
+
+  acquire(&swap.lock);
+  for (i = 0; i < n; i++) {
+    e = &swap.ent[ent + i];
+    if (z[i] && e->ref > 0 && zswap_bytes + len[i] <= zswapmax * 1024) {
+      e->zdata = z[i];
+      e->zlen = len[i];
+      zswap_pages++;
+      zswap_bytes += len[i];
+      z[i] = 0;
+    } else if (e->ref > 0) {
+      e->slot = slotalloc();
+    }
+  }
+  release(&swap.lock);
+  for (i = 0; i < n; i++)
+    if (z[i])
+      kfree(z[i]);
+
+  // a fault on a page still being written copies e->page
+  for (i = 0; i < n; i = j) {
+    e = &swap.ent[ent + i];
+    for (j = i + 1; j < n && e->slot >= 0 &&
+                    swap.ent[ent + j].slot == e->slot + (j - i);
+         j++)
+      ;
+    if (e->slot >= 0)
+      swaprw(e->slot, pages + i, j - i, 1);
+  }
+
+  acquire(&swap.lock);
+  for (i = 0; i < n; i++) {
+    e = &swap.ent[ent + i];
+    e->busy = 0;
+    if (e->ref > 0 && !e->zdata && e->slot < 0) {
+      pages[i] = 0; // nowhere to put it; the entry keeps it
+      continue;
+    }
+    e->page = 0;
+    if (e->ref == 0)
+      entfree(e);
+  }
+  release(&swap.lock);
+  for (i = 0; i < n; i++)
+    if (pages[i])
+      kfree(pages[i]);
+  __sync_fetch_and_add(&swap_outs, n);
+}
+
+// Tests whether the page of entry e is read from the disk, and, if so,
+// whether it is in the slot after that of entry d. Caller must hold
+// swap.lock.
+static int ondisk(struct swapent *e, struct swapent *d) {
+  return !e->page && !e->zdata && (!d || e->slot == d->slot + 1);
+}
+
+// Reads the pages of the entries from ent on into the n pages at
+// pages. The caller must hold a reference to each entry, which keeps
+// its compressed page from being freed while it is decompressed
+// outside swap.lock. Pages in the compressed store are decompressed,
+// ones still in memory are copied, and the runs of the others in
+// neighbouring slots each take one disk request.
+void swapin(uint ent, char **pages, int n) {
+  struct swapent *e;
+  char *z;
+  int i, j, zlen;
+
+  assert(n <= SWAPCLUSTER);
+  for (i = 0; i < n; i = j) {
+    e = &swap.ent[ent + i];
+    z = 0;
+    acquire(&swap.lock);
+    if (e->page) {
+      memmove(pages[i], e->page, PGSIZE);
+    } else if (e->zdata) {
+      z = e->zdata;
+      zlen = e->zlen;
+      zswap_hits++;
+    }
+    if (!ondisk(e, 0)) {
+      release(&swap.lock);
+      if (z && lz_decompress((uchar *)z, zlen, (uchar *)pages[i], PGSIZE) !=
+                   PGSIZE)
+        panic("swapin: corrupt compressed page");
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < n && ondisk(&swap.ent[ent + j], &swap.ent[ent + j - 1]);
+         j++)
+      ;
+    zswap_misses += j - i;
+    release(&swap.lock);
+    swaprw(e->slot, pages + i, j - i, 0);
+    num_disk_reads += j - i;
+  }
+}
+
+// Takes another reference to entry ent, for a copy of the vpage_info
+// that holds it.
+void swapdup(uint ent) {
+  acquire(&swap.lock);
+  assert(swap.ent[ent].ref > 0 && swap.ent[ent].ref < 255);
+  swap.ent[ent].ref++;
+  release(&swap.lock);
+}
+
+// Drops a reference to entry ent, freeing it with the last one, or
+// leaving that to swapout() if it is not done with the entry yet.
+void swapfree(uint ent) {
+  struct swapent *e = &swap.ent[ent];
+
+  acquire(&swap.lock);
+  assert(e->ref > 0);
+  if (--e->ref == 0) {
+    pages_in_swap--;
+    if (!e->busy)
+      entfree(e);
+  }
+  release(&swap.lock);
+}
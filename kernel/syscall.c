@@ -23,6 +23,8 @@
     v = &myproc()->vspace;                                                     \
     for (r = v->regions; r < &v->regions[NREGIONS]; r++) {                     \
       if (vregioncontains(r, addr, sizeof(type))) {                            \
+        if (vspacepopulate(v, addr, sizeof(type)) < 0)                         \
+          return -1;                                                           \
         *ip = *(type *)(addr);                                                 \
         return 0;                                                              \
       }                                                                        \
@@ -52,6 +54,10 @@ syscall_gen_fetcher(int) syscall_gen_fetcher(int64_t)
       *pp = (char *)addr;
       ep = (char *)VRTOP(r);
       for (s = *pp; s < ep; s++) {
+        // the string may run into code that was never read in
+        if ((s == *pp || (uint64_t)s % PGSIZE == 0) &&
+            vspacepopulate(v, (uint64_t)s, 1) < 0)
+          return -1;
         if (*s == 0)
           return s - *pp;
       }
@@ -106,6 +112,8 @@ int argptr(int n, char **pp, int size) {
   v = &myproc()->vspace;
   for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
     if (vregioncontains(r, i, size)) {
+      if (vspacepopulate(v, i, size) < 0)
+        return -1;
       *pp = (char *)i;
       return 0;
     }
@@ -143,6 +151,14 @@ extern int sys_uptime(void);
 extern int sys_sysinfo(void);
 extern int sys_crashn(void);
 extern int sys_unlink(void);
+extern int sys_vmtune(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_spawn(void);
+extern int sys_shmcreate(void);
+extern int sys_shmattach(void);
+extern int sys_shmdetach(void);
+extern int sys_shmremove(void);
 
 static int (*syscalls[])(void) = {
     [SYS_fork] = sys_fork,       [SYS_exit] = sys_exit,
@@ -154,7 +170,11 @@ static int (*syscalls[])(void) = {
     [SYS_uptime] = sys_uptime,   [SYS_open] = sys_open,
     [SYS_write] = sys_write,     [SYS_close] = sys_close,
     [SYS_sysinfo] = sys_sysinfo, [SYS_crashn] = sys_crashn,
-    [SYS_unlink] = sys_unlink,
+    [SYS_unlink] = sys_unlink,   [SYS_vmtune] = sys_vmtune,
+    [SYS_mmap] = sys_mmap,       [SYS_munmap] = sys_munmap,
+    [SYS_spawn] = sys_spawn,     [SYS_shmcreate] = sys_shmcreate,
+    [SYS_shmattach] = sys_shmattach, [SYS_shmdetach] = sys_shmdetach,
+    [SYS_shmremove] = sys_shmremove,
 };
 
 void syscall(void) {
@@ -171,6 +191,8 @@ void syscall(void) {
 
 int sys_sysinfo(void) {
   struct sys_info *info;
+  struct cpu *c;
+  int i;
 
   if (argptr(0, (void *)&info, sizeof(struct sys_info)) < 0)
     return -1;
@@ -179,7 +201,46 @@ int sys_sysinfo(void) {
   info->pages_in_swap = pages_in_swap;
   info->free_pages = free_pages;
   info->num_page_faults = num_page_faults;
+  info->num_minor_faults = num_minor_faults;
+  info->num_major_faults = num_major_faults;
   info->num_disk_reads = num_disk_reads;
 
+  info->kmag_hits = info->kmag_refills = info->kmag_drains = 0;
+  for (c = cpus; c < &cpus[ncpu]; c++) {
+    info->kmag_hits += c->kmag.hits;
+    info->kmag_refills += c->kmag.refills;
+    info->kmag_drains += c->kmag.drains;
+  }
+  for (i = 0; i < KALLOC_NORDER; i++)
+    info->free_blocks[i] = kalloc_nfree(i);
+  kzero_stats(&info->zero_hits, &info->zero_misses, &info->zero_pool);
+  info->vspace_full_updates = vspace_full_updates;
+  info->vspace_range_updates = vspace_range_updates;
+  info->cr3_loads = cr3_loads;
+  info->cr3_flushes = cr3_flushes;
+  info->pcid_rollovers = pcid_rollovers;
+  info->faultaround_mapped = faultaround_mapped;
+  info->faultaround_used = faultaround_used;
+  info->faultaround_unused = faultaround_unused;
+  info->evictions = evictions;
+  info->refaults = refaults;
+  info->zeropage_maps = zeropage_maps();
+  info->zeropage_faults = zeropage_faults;
+  info->swap_outs = swap_outs;
+  info->swap_ins = swap_ins;
+  info->swap_ahead = swap_ahead;
+  info->swap_ios = swap_ios;
+  info->zswap_pages = zswap_pages;
+  info->zswap_bytes = zswap_bytes;
+  info->zswap_max = zswapmax;
+  info->zswap_hits = zswap_hits;
+  info->zswap_misses = zswap_misses;
+  pagecache_stats(&info->pcache_pages, &info->pcache_shared,
+                  &info->pcache_hits, &info->pcache_misses);
+  info->exec_count = exec_count;
+  info->exec_cycles = exec_cycles;
+  info->spawn_count = spawn_count;
+  info->spawn_cycles = spawn_cycles;
+
   return 0;
 }
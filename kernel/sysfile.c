@@ -9,10 +9,12 @@
 #include <fcntl.h>
 #include <file.h>
 #include <fs.h>
+#include <mman.h>
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
 #include <sleeplock.h>
+#include <spawn.h>
 #include <spinlock.h>
 #include <stat.h>
 
@@ -118,6 +120,67 @@ int sys_fstat(void) {
   return file_stat(fd, stat_ptr);
 }
 
+/*
+ * arg0: void * [preferred address of the mapping, may be 0]
+ * arg1: int [length of the mapping in bytes]
+ * arg2: int [protection, PROT_READ optionally with PROT_WRITE]
+ * arg3: int [MAP_SHARED or MAP_PRIVATE]
+ * arg4: int [file descriptor]
+ * arg5: int [offset in the file, page aligned]
+ *
+ * Maps part of an open file into the address space, see mman.h.
+ * The file's pages are shared with the page cache that read() uses;
+ * they are read in when first touched. The file system is read-only,
+ * so what a shared mapping writes is kept only while the pages stay
+ * cached (see pagecache.c).
+ *
+ * Returns the address of the mapping, or -1 on error.
+ *
+ * Error conditions:
+ * arg4 is not a file descriptor open for reading on a file, or, for a
+ *   shared writable mapping, not open for reading and writing
+ * arg5 is not page aligned or not within the file
+ * arg1 is not positive, or no room is left for the mapping
+ * arg2 or arg3 is invalid
+ */
+int sys_mmap(void) {
+  int64_t addr;
+  int len, prot, flags, fd, off;
+  struct file_info *f;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+      argint(3, &flags) < 0 || argint(4, &fd) < 0 || argint(5, &off) < 0)
+    return -1;
+  if (len <= 0 || off < 0 || fd < 0 || fd >= NOFILE)
+    return -1;
+  if (!(f = myproc()->files[fd]) || f->isPipe || f->mode == O_WRONLY ||
+      f->node->type == T_DEV)
+    return -1;
+  // writes through a shared mapping reach the page cache, which other
+  // processes read and run code from
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && f->mode != O_RDWR)
+    return -1;
+  return vspacemmap(&myproc()->vspace, addr, len, prot, flags, f->node, off);
+}
+
+/*
+ * arg0: void * [start of the range, page aligned]
+ * arg1: int [length of the range in bytes]
+ *
+ * Removes the mappings in the range. A mapping may be cut short at
+ * its end, but not at its start or in the middle.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+int sys_munmap(void) {
+  int64_t addr;
+  int len;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return vspacemunmap(&myproc()->vspace, addr, len);
+}
+
 int sys_open(void) {
   // LAB1
   char *file_path;
@@ -141,9 +204,91 @@ int sys_open(void) {
   return file_open(file_mode, file_path);
 }
 
+// Fetches the user argv array at uargv, of at most MAXARG strings.
+static int fetchargv(int64_t uargv, char **argv) {
+  int64_t uarg;
+  int i;
+
+  for (i = 0;; i++) {
+    if (i > MAXARG)
+      return -1;
+    if (fetchint64_t(uargv + i * sizeof(uint64_t), &uarg) < 0)
+      return -1;
+    if (uarg == 0) {
+      argv[i] = 0;
+      return 0;
+    }
+    if (fetchstr(uarg, &argv[i]) < 0)
+      return -1;
+  }
+}
+
+/*
+ * arg0: char * [path to the executable file]
+ * arg1: char * [] [list of arguments, terminated by a null pointer]
+ *
+ * Replaces the current program with the one at path, passing it
+ * argv. Does not return on success.
+ *
+ * Error conditions:
+ * path or argv, or one of its strings, is not in the address space
+ * more than MAXARG arguments
+ * path is not a valid executable
+ */
 int sys_exec(void) {
   // LAB2
-  return -1;
+  char *path, *argv[MAXARG + 1];
+  int64_t uargv;
+
+  if (argstr(0, &path) < 0 || argint64(1, &uargv) < 0 ||
+      fetchargv(uargv, argv) < 0)
+    return -1;
+  return exec(path, argv);
+}
+
+/*
+ * arg0: char * [path of the program]
+ * arg1: char ** [argv, as for exec]
+ * arg2: struct spawn_action * [file actions]
+ * arg3: int [number of file actions]
+ *
+ * Start a child running the program, with the parent's file
+ * descriptors changed by the file actions, without copying the
+ * parent's address space.
+ *
+ * Return the child's pid on success, -1 otherwise
+ *
+ * Error conditions:
+ * the program cannot be loaded
+ * more than NSPAWNACT file actions, or an invalid one
+ * a file action fails
+ */
+int sys_spawn(void) {
+  char *path, *argv[MAXARG + 1];
+  struct spawn_action *uacts, acts[NSPAWNACT];
+  int64_t uargv;
+  int i, nact;
+
+  if (argstr(0, &path) < 0 || argint64(1, &uargv) < 0 ||
+      fetchargv(uargv, argv) < 0 || argint(3, &nact) < 0 ||
+      nact < 0 || nact > NSPAWNACT)
+    return -1;
+  if (nact > 0 &&
+      argptr(2, (char **)&uacts, nact * sizeof(*uacts)) < 0)
+    return -1;
+
+  // copy the actions so that their paths are checked once
+  memmove(acts, uacts, nact * sizeof(*uacts));
+  for (i = 0; i < nact; i++) {
+    if (acts[i].op != SPAWN_OPEN)
+      continue;
+    if (fetchstr((uint64_t)acts[i].path, &acts[i].path) < 0)
+      return -1;
+    if (acts[i].mode != O_RDONLY && acts[i].mode != O_WRONLY &&
+        acts[i].mode != O_RDWR)
+      return -1;
+  }
+  return spawn(path, argv, acts, nact);
 }
 
 int sys_pipe(void) {
@@ -5,6 +5,7 @@
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
+#include <vmtune.h>
 #include <x86_64.h>
 
 int sys_crashn(void) {
@@ -55,8 +56,11 @@ int sys_getpid(void) { return myproc()->pid; }
  * -1 should still be returned, and nothing should be added to the heap.
  */
 int sys_sbrk(void) {
-  // LAB3
-  return 0;
+  int n;
+
+  if (argint(0, &n) < 0)
+    return -1;
+  return vspacegrowheap(&myproc()->vspace, n);
 }
 
 int sys_sleep(void) {
@@ -88,3 +92,102 @@ int sys_uptime(void) {
   release(&tickslock);
   return xticks;
 }
+
+/*
+ * arg0: knob, one of the VMT_ constants in vmtune.h
+ * arg1: new value for the knob
+ *
+ * Sets a virtual memory tunable.
+ * Returns the previous value, or -1 if the knob or value is invalid.
+ */
+int sys_vmtune(void) {
+  int knob, value, old;
+  struct vregion *heap;
+
+  if (argint(0, &knob) < 0 || argint(1, &value) < 0)
+    return -1;
+
+  switch (knob) {
+  case VMT_HEAPLARGE:
+    if (value != 0 && value != 1)
+      return -1;
+    heap = &myproc()->vspace.regions[VR_HEAP];
+    old = heap->large;
+    heap->large = value;
+    return old;
+  case VMT_FAULTAROUND:
+    if (value < 0 || value > FAULTAROUNDMAX)
+      return -1;
+    old = faultaround;
+    faultaround = value;
+    return old;
+  case VMT_ZSWAPMAX:
+    if (value < 0)
+      return -1;
+    old = zswapmax;
+    zswapmax = value;
+    return old;
+  default:
+    return -1;
+  }
+}
+
+/*
+ * arg0: key of the shared memory segment
+ * arg1: size of the segment in bytes
+ *
+ * Finds the shared memory segment with the key, creating it zeroed if
+ * there is none.
+ * Returns its id, or -1 if the size is invalid or larger than that of
+ * the existing segment, or if out of segments or memory.
+ */
+int sys_shmcreate(void) {
+  int key, size;
+
+  if (argint(0, &key) < 0 || argint(1, &size) < 0 || size <= 0)
+    return -1;
+  return shmcreate(key, size);
+}
+
+/*
+ * arg0: id of a shared memory segment, from shmcreate()
+ *
+ * Maps the segment, writable, into the mmap() area.
+ * Returns the address of the mapping, or -1 on error.
+ */
+int sys_shmattach(void) {
+  int id;
+
+  if (argint(0, &id) < 0)
+    return -1;
+  return shmattach(id);
+}
+
+/*
+ * arg0: void * [address returned by shmattach()]
+ *
+ * Unmaps the shared memory segment attached there.
+ * Returns 0 on success, -1 otherwise.
+ */
+int sys_shmdetach(void) {
+  int64_t addr;
+
+  if (argint64(0, &addr) < 0)
+    return -1;
+  return vspaceshmdetach(&myproc()->vspace, addr);
+}
+
+/*
+ * arg0: id of a shared memory segment, from shmcreate()
+ *
+ * Removes the segment: its key is free again, and it can no longer be
+ * attached. It is freed once the attachments it still has are gone.
+ * Returns 0 on success, -1 if there is no segment with the id.
+ */
+int sys_shmremove(void) {
+  int id;
+
+  if (argint(0, &id) < 0)
+    return -1;
+  return shmremove(id);
+}
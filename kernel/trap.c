@@ -6,6 +6,7 @@
 #include <proc.h>
 #include <spinlock.h>
 #include <trap.h>
+#include <vspace.h>
 #include <x86_64.h>
 
 // Interrupt descriptor table (shared by all CPUs).
@@ -15,6 +16,12 @@ struct spinlock tickslock;
 uint ticks;
 
 int num_page_faults = 0;
+int num_minor_faults = 0;
+int num_major_faults = 0;
+int exec_count = 0;       // exec()s that reached their first instruction
+uint64_t exec_cycles = 0; // cycles from those exec()s to that point
+int spawn_count = 0;       // spawn()ed children that reached their first
+uint64_t spawn_cycles = 0; // instruction, and the cycles it took them
 
 void tvinit(void) {
   int i;
@@ -31,6 +38,7 @@ void idtinit(void) { lidt((void *)idt, sizeof(idt)); }
 
 void trap(struct trap_frame *tf) {
   uint64_t addr;
+  int fault;
 
   if (tf->trapno == TRAP_SYSCALL) {
     if (myproc()->killed)
@@ -79,7 +87,27 @@ void trap(struct trap_frame *tf) {
     if (tf->trapno == TRAP_PF) {
       num_page_faults += 1;
 
-      // LAB3: page fault handling logic here
+      // Resolve it against the process' vspace. The kernel faults on
+      // user memory too, when it touches it during a system call.
+      if (myproc() &&
+          (fault = vspacefault(&myproc()->vspace, addr, tf->err)) >= 0) {
+        if (fault == FAULT_MAJOR)
+          num_major_faults += 1;
+        else
+          num_minor_faults += 1;
+        // the first instruction of a new program can now run
+        if (myproc()->exectsc) {
+          exec_cycles += rdtsc() - myproc()->exectsc;
+          exec_count += 1;
+          myproc()->exectsc = 0;
+        }
+        if (myproc()->spawntsc) {
+          spawn_cycles += rdtsc() - myproc()->spawntsc;
+          spawn_count += 1;
+          myproc()->spawntsc = 0;
+        }
+        break;
+      }
 
       if (myproc() == 0 || (tf->cs & 3) == 0) {
         // In kernel, it must be our mistake.
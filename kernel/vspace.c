@@ -1,15 +1,19 @@
 #include <cdefs.h>
+#include <cpuid.h>
 #include <defs.h>
 #include <elf.h>
 #include <memlayout.h>
+#include <mman.h>
 #include <vspace.h>
 #include <proc.h>
+#include <slab.h>
+#include <trap.h>
 #include <x86_64.h>
 #include <x86_64vm.h>
 
 // given a virtual address and the vregion struct
 // returns the phsical page index
-static int
+static uint64_t
 va2vpi_idx(struct vregion *r, uint64_t va)
 {
   if (r->dir == VRDIR_UP)
@@ -29,22 +33,74 @@ x86perms(struct vpage_info *vpi)
   int perms = PTE_U; // always user if in a virtual region
   if (vpi->present)
     perms |= PTE_P;
-  if (vpi->writable)
+  if (vpi->writable && !vpi->cow)
     perms |= PTE_W;
   return perms;
 }
 
 extern pml4e_t *kpml4;  // kernel page table
 
+int vspace_full_updates;   // calls to vspaceupdate()
+int vspace_range_updates;  // calls to vspaceupdaterange()
+
+int cr3_loads;        // user page tables installed
+int cr3_flushes;      // ... that flushed the TLB entries of the vspace
+int pcid_rollovers;   // whole-TLB flushes to recycle the PCIDs
+
+// Process Context IDs. With CR4_PCIDE set, TLB entries are tagged with
+// the PCID in CR3, so a vspace's entries survive a switch to another
+// vspace and back. PCID 0 is the kernel page table's; each cpu hands
+// out the others in increasing order to vspaces as they are installed
+// on it, with interrupts off, so no lock is needed. When they run out,
+// the cpu flushes its whole TLB and starts a new generation. A vspace
+// keeps its PCID only while it is installed on the cpu that handed it
+// out, in that cpu's current generation; otherwise it gets a fresh one
+// and its entries are flushed. A PCID is thus never shared on a cpu
+// within a generation, entries left behind by a freed vspace are gone
+// before its PCID is handed out again, and a vspace that moved to
+// another cpu never picks up entries it left on the old one.
+static struct {
+  int enabled;
+} pcid;
+
+int faultaround = 16;     // pages mapped around a fault, see vmtune()
+int faultaround_mapped;   // pages mapped speculatively by fault-around
+int faultaround_used;     // ... that were accessed afterwards
+int faultaround_unused;   // ... that were freed without being accessed
+
+int evictions;  // pages taken from an address space by vspacereclaim()
+int refaults;   // ... that were faulted back in afterwards
+
+// Read faults on untouched heap and stack pages map this page
+// copy-on-write rather than allocating one. It holds a reference of
+// its own, so vpibreakcow() never takes it over.
+static char *zeropage;
+int zeropage_faults;  // read faults that mapped the zero page
+
+static struct kmem_cache *vpi_cache;       // struct vpi_page objects
+static struct kmem_cache *vpi_node_cache;  // struct vpi_node objects
+
 // allocates space for the kernel page table and populates
 // it with the kernel's virtual address mapping after the
 // virtual address space has been initialized by the kernel
 void
 vspacebootinit(void)
 {
-  kpml4 = setupkvm(); // sets up the kernel's page table
+  kpml4 = setupkpml4(); // sets up the kernel's page table
   vspaceinstallkern();  // installs the kernel mapping in the table
   seginit();   // segment table
+  vpi_cache = kmem_cache_create("vpi_page", sizeof(struct vpi_page), 0);
+  vpi_node_cache = kmem_cache_create("vpi_node", sizeof(struct vpi_node), 0);
+  assertm(vpi_cache && vpi_node_cache, "vspacebootinit: no vpi caches");
+  zeropage = kalloc_zeroed();
+  assertm(zeropage, "vspacebootinit: no zero page");
+}
+
+// Returns the number of mappings of the zero page.
+int
+zeropage_maps(void)
+{
+  return pa2page(V2P(zeropage))->ref - 1;
 }
 
 // initializes a given vspace struct, by creating the page table
@@ -60,6 +116,10 @@ vspaceinit(struct vspace *vs)
   for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++) {
     memset(vr, 0, sizeof(struct vregion));
   }
+  vs->pcid = 0;
+  vs->pcidcpu = 0;
+  vs->pcidgen = 0;
+  vs->tlbstale = 0;
 
   vs->regions[VR_CODE].dir   = VRDIR_UP;
   vs->regions[VR_HEAP].dir   = VRDIR_UP;
@@ -68,6 +128,35 @@ vspaceinit(struct vspace *vs)
   return 0;
 }
 
+// Backs the 2MB-aligned range at va with one physically contiguous,
+// 2MB-aligned block, so that vspaceupdate() can map it with a single
+// large page. The block's pages are still freed one at a time.
+// Returns -1 if no such block is free.
+static int
+vregionaddlarge(struct vregion *vr, uint64_t va, short present, short writable)
+{
+  struct vpage_info *vpi;
+  char *mem;
+  int i;
+
+  if (!(mem = kalloc_split(PD_SHIFT - PT_SHIFT)))
+    return -1;
+  memset(mem, 0, PD_SIZE);
+
+  for (i = 0; i < PTRS_PER_PT; i++) {
+    if (!(vpi = va2vpage_info(vr, va + i * PGSIZE))) {
+      for (i = 0; i < PTRS_PER_PT; i++)
+        kfree(mem + i * PGSIZE);
+      return -1;
+    }
+    vpi->used = 1;
+    vpi->present = present;
+    vpi->writable = writable;
+    vpi->ppn = PGNUM(V2P(mem)) + i;
+  }
+  return 0;
+}
+
 // Adds a mapping in the vregion from the virtual address from_va of size sz with the appropriate
 // permissions. If size spans more than one page, multiple physical pages are mapped into the
 // page table
@@ -84,13 +173,18 @@ vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present,
     return 0;
 
   for (a = PGROUNDUP(from_va); a < from_va + sz; a += PGSIZE) {
+    if (vr->large && a % PD_SIZE == 0 && a + PD_SIZE <= from_va + sz &&
+        vregionaddlarge(vr, a, present, writable) == 0) {
+      a += PD_SIZE - PGSIZE;
+      continue;
+    }
+
     if (!(vpi = va2vpage_info(vr, a)))
       goto addmap_failure;
 
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if (!mem)
       goto addmap_failure;
-    memset(mem, 0, PGSIZE);
 
     vpi->used = 1;
     vpi->present = present;
@@ -101,7 +195,7 @@ vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present,
 
 addmap_failure:
   for (a -= PGSIZE; a >= PGROUNDUP(from_va); a -= PGSIZE) {
-    assertm(vpi = va2vpage_info(vr, a), "vpi info missing");
+    assertm(vpi = vregionlookup(vr, a), "vpi info missing");
     kfree(P2V(vpi->ppn << PT_SHIFT));
 
     vpi->used = 0;
@@ -126,7 +220,7 @@ vradddata(struct vregion *r, uint64_t va, char *data, int sz, short present, sho
     return ret;
 
   for (i = 0; i < sz; i += PGSIZE) {
-    vpi = va2vpage_info(r, va + i);
+    vpi = vregionlookup(r, va + i);
     assert(vpi->used);
     n = min((uint64_t)sz - i, (uint64_t)PGSIZE);
     memmove(P2V(vpi->ppn << PT_SHIFT), data + i, n);
@@ -143,7 +237,7 @@ vrloaddata(struct vregion *r, uint64_t va, struct inode *ip, uint offset, uint s
   assertm(va % PGSIZE == 0, "va must be page aligned");
 
   for (i = 0; i < sz; i += PGSIZE) {
-    vpi = va2vpage_info(r, va + i);
+    vpi = vregionlookup(r, va + i);
     assertm(vpi->used, "page must be allocated");
     n = min(sz - i, (uint) PGSIZE);
     if (readi(ip, P2V(vpi->ppn << PT_SHIFT), offset + i, n) != n)
@@ -165,6 +259,9 @@ vspaceinitcode(struct vspace *vs, char *init, uint64_t size)
   // code pages and 2 pages reserved for sds
   vs->regions[VR_CODE].va_base = 0x10000;
   vs->regions[VR_CODE].size = PGROUNDUP(size) + 2 * PGSIZE;
+  // empty heap after code, leave 1 page in between
+  vs->regions[VR_HEAP].va_base = VRTOP(&vs->regions[VR_CODE]) + PGSIZE;
+  vs->regions[VR_HEAP].size = 0;
   assertm(
     vradddata(&vs->regions[VR_CODE], 0x10000, init, size, VPI_PRESENT, VPI_WRITABLE) == 0,
     "failed to allocate init code data"
@@ -187,18 +284,28 @@ vspaceinitcode(struct vspace *vs, char *init, uint64_t size)
 // vspace for a process. The program must be ELF compliant. The
 // first instruction for the program is returned in the output
 // parameter rip
+//
+// Nothing is read in here: each loadable segment is only recorded in
+// the code region, and vspacefault() reads its pages from the file as
+// they are touched. The region holds a reference to the inode until
+// the vspace is freed. Segments beyond NVRSEG are loaded eagerly.
+//
+// returns 0 on success, -1 if the program cannot be loaded
 int
 vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
 {
   bool first_section = true;
-  int off, sz, i;
+  int off, i;
   uint64_t code_end;
+  struct vregion *code = &vs->regions[VR_CODE];
+  struct vrseg *seg;
   struct inode *ip;
   struct proghdr ph;
   struct elfhdr elf;
+  short writable;
 
   if((ip = namei(path)) == 0){
-    return 0;
+    return -1;
   }
 
   locki(ip);
@@ -219,50 +326,384 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
       continue;
     if(ph.memsz < ph.filesz)
       goto elf_failure;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE)
+      goto elf_failure;
+    if(ph.vaddr % PGSIZE != 0)
       goto elf_failure;
 
     if (first_section) {
-      vs->regions[VR_CODE].va_base = PGROUNDDOWN(ph.vaddr);
+      code->va_base = PGROUNDDOWN(ph.vaddr);
       first_section = false;
     }
 
     // use readelf --sections --program-headers -W <executable> to view the ELF headers and the permissions
-    if((sz = vregionaddmap(&vs->regions[VR_CODE], (uint64_t)ph.vaddr, ph.memsz, VPI_PRESENT, (ph.flags & ELF_PROG_FLAG_WRITE) ? VPI_WRITABLE : VPI_READONLY)) < 0)
-     goto elf_failure;
-    if(ph.vaddr % PGSIZE != 0)
-      goto elf_failure;
-
+    writable = (ph.flags & ELF_PROG_FLAG_WRITE) ? VPI_WRITABLE : VPI_READONLY;
     code_end = ph.vaddr + ph.memsz;
 
-    if(vrloaddata(&vs->regions[VR_CODE], ph.vaddr, ip, ph.off, ph.filesz) < 0)
-     goto elf_failure;
+    if (code->nseg == NVRSEG) {
+      if (vregionaddmap(code, ph.vaddr, ph.memsz, VPI_PRESENT, writable) < 0 ||
+          vrloaddata(code, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+        goto elf_failure;
+      continue;
+    }
+    seg = &code->seg[code->nseg++];
+    seg->va = ph.vaddr;
+    seg->memsz = ph.memsz;
+    seg->off = ph.off;
+    seg->filesz = ph.filesz;
+    seg->writable = writable;
   }
 
-  assert(!first_section);
+  if (first_section)
+    goto elf_failure;
 
   // Set code region
-  vs->regions[VR_CODE].size = code_end - vs->regions[VR_CODE].va_base;
+  code->size = code_end - code->va_base;
+  code->ip = ip;
 
   // Place after code, leave 1 page in between
   vs->regions[VR_HEAP].va_base = PGROUNDUP(code_end) + PGSIZE;
   vs->regions[VR_HEAP].size = 0;
 
   unlocki(ip);
-  irelease(ip);
   *rip = elf.entry;
-  return sz;
+  return 0;
 elf_failure:
-  if(ip) {
-    unlocki(ip);
-    irelease(ip);
+  code->nseg = 0;
+  unlocki(ip);
+  irelease(ip);
+  return -1;
+}
+
+// finds the segment of vr that va lies in, or returns 0
+static struct vrseg *
+vregionseg(struct vregion *vr, uint64_t va)
+{
+  struct vrseg *seg;
+
+  for (seg = vr->seg; seg < &vr->seg[vr->nseg]; seg++)
+    if (va >= seg->va && va < seg->va + seg->memsz)
+      return seg;
+  return 0;
+}
+
+// Tests whether page va of seg, a segment of vr, can be mapped
+// straight from the page cache: it must start at a page-aligned file
+// offset, and hold either a whole page of the segment's data, or the
+// end of the file when the segment runs up to it.
+static int
+vrsegcached(struct vregion *vr, struct vrseg *seg, uint64_t va)
+{
+  uint64_t pos = va - seg->va;
+
+  return seg->off % PGSIZE == 0 && pos < seg->filesz &&
+         (pos + PGSIZE <= seg->filesz ||
+          seg->off + seg->filesz == vr->ip->size);
+}
+
+// Points vpi, the info of a page of seg, at mem, the page cache page
+// holding its data. Read-only and shared mappings use the page as is.
+// Private writable mappings get it copy-on-write, so that a write
+// never reaches the cache.
+static void
+vpisetcached(struct vregion *vr, struct vrseg *seg, struct vpage_info *vpi,
+             char *mem)
+{
+  vpi->used = 1;
+  vpi->present = VPI_PRESENT;
+  vpi->writable = seg->writable;
+  vpi->cow = seg->writable && !vr->shared;
+  vpi->ppn = PGNUM(V2P(mem));
+  vpi->evicted = 0;
+}
+
+// Maps the cached pages of segment seg in the faultaround-page window
+// around va, which was just faulted in. Pages that are not cached are
+// left to fault in on their own.
+static void
+vregionfaultaroundfile(struct vspace *vs, struct vregion *vr,
+                       struct vrseg *seg, uint64_t va)
+{
+  struct vpage_info *vpi;
+  uint64_t start, end, a;
+  char *mem;
+  int n = 0;
+
+  if (faultaround <= 1)
+    return;
+  start = va - (va >> PAGE_SHIFT) % faultaround * PGSIZE;
+  end = start + (uint64_t)faultaround * PGSIZE;
+  start = max(start, seg->va);
+  end = min(end, seg->va + seg->memsz);
+
+  for (a = start; a < end; a += PGSIZE) {
+    if (a == va || !vrsegcached(vr, seg, a) ||
+        ((vpi = vregionlookup(vr, a)) && vpi->used))
+      continue;
+    if (!(mem = pagecache_peek(vr->ip, seg->off + (a - seg->va))))
+      continue;
+    if (!(vpi = va2vpage_info(vr, a))) {
+      kfree(mem);
+      break;
+    }
+    vpisetcached(vr, seg, vpi, mem);
+    vpi->around = 1;
+    n++;
+  }
+  if (n == 0)
+    return;
+  __sync_fetch_and_add(&faultaround_mapped, n);
+  vspaceupdaterange(vs, start, end - start);
+}
+
+// Fills in page va of vr, which must lie in one of the region's
+// file-backed segments, from the region's inode. Pages that
+// vrsegcached() allows are mapped from the page cache, and so shared
+// with every other vspace mapping them; the rest are private copies.
+// A write to a private writable page that is not present yet gets a
+// private copy right away.
+//
+// returns FAULT_MAJOR if the disk had to be read, FAULT_MINOR if the
+// data was found in the page or buffer cache, -1 if va is in no
+// segment, the access is not allowed, or memory ran out
+static int
+vregionfaultfile(struct vspace *vs, struct vregion *vr, uint64_t va, int err)
+{
+  struct vrseg *seg;
+  struct vpage_info *vpi;
+  uint64_t pos;
+  uint n;
+  int reads;
+  char *mem;
+
+  if (!(seg = vregionseg(vr, va)) || ((err & PF_W) && !seg->writable))
+    return -1;
+
+  if (!(vpi = va2vpage_info(vr, va)))
+    return -1;
+  if (vpi->used)
+    return vpi->present && vspaceupdaterange(vs, va, PGSIZE) == 0 ?
+      FAULT_MINOR : -1;
+  if (vpi->evicted) {
+    vpi->evicted = 0;
+    __sync_fetch_and_add(&refaults, 1);
+  }
+
+  pos = va - seg->va;
+  reads = num_disk_reads;
+  if (vrsegcached(vr, seg, va) && (vr->shared || !(err & PF_W))) {
+    // a shared mapping's writes must reach the cache, so its page has
+    // to be the cache's
+    mem = vr->shared ? pagecache_getcached(vr->ip, seg->off + pos) :
+                       pagecache_get(vr->ip, seg->off + pos);
+    if (!mem)
+      return -1;
+    vpisetcached(vr, seg, vpi, mem);
+  } else {
+    if (!(mem = kalloc_zeroed()))
+      return -1;
+    if (pos < seg->filesz) {
+      n = min((uint64_t)seg->filesz - pos, (uint64_t)PGSIZE);
+      if (concurrent_readi(vr->ip, mem, seg->off + pos, n) != n) {
+        kfree(mem);
+        return -1;
+      }
+    }
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = seg->writable;
+    vpi->ppn = PGNUM(V2P(mem));
   }
 
+  if (vspaceupdaterange(vs, va, PGSIZE) < 0)
+    return -1;
+  vregionfaultaroundfile(vs, vr, seg, va);
+  return num_disk_reads != reads ? FAULT_MAJOR : FAULT_MINOR;
+}
+
+// Tests whether page va of vr is in swap, at swap entry ent.
+static int
+vregioninswap(struct vregion *vr, uint64_t va, uint64_t ent)
+{
+  struct vpage_info *vpi;
+
+  return va >= VRBOT(vr) && va < VRTOP(vr) &&
+         (vpi = vregionlookup(vr, va)) && vpi->swapped && vpi->ppn == ent;
+}
+
+// Reads page va of vr, which is in swap, back in. The neighbours of va
+// that went out to the neighbouring swap entries along with it (see
+// vspaceswapcluster()) are read ahead by the same swapin(), up to
+// SWAPCLUSTER pages in all, unless memory is short.
+//
+// returns FAULT_MAJOR, or -1 if out of memory
+static int
+vregionswapin(struct vspace *vs, struct vregion *vr, uint64_t va)
+{
+  struct vpage_info *vpi;
+  char *pages[SWAPCLUSTER];
+  uint64_t ent, lo, hi, start;
+  int i, n;
+
+  ent = vregionlookup(vr, va)->ppn;
+  // pages [va - lo, va + hi) are in entries [ent - lo, ent + hi)
+  for (lo = 0, hi = 1; lo + hi < SWAPCLUSTER &&
+       free_pages > RECLAIMLOW + (int)(lo + hi);) {
+    if (vregioninswap(vr, va + hi * PGSIZE, ent + hi))
+      hi++;
+    else if (vregioninswap(vr, va - (lo + 1) * PGSIZE, ent - lo - 1))
+      lo++;
+    else
+      break;
+  }
+  n = lo + hi;
+  start = va - lo * PGSIZE;
+
+  for (i = 0; i < n; i++) {
+    if (!(pages[i] = kalloc())) {
+      while (i-- > 0)
+        kfree(pages[i]);
+      return -1;
+    }
+  }
+  swapin(ent - lo, pages, n);
+
+  // the process was asleep, but nothing else touches pages in swap
+  for (i = 0; i < n; i++) {
+    vpi = vregionlookup(vr, start + i * PGSIZE);
+    swapfree(vpi->ppn);
+    vpi->swapped = 0;
+    vpi->present = VPI_PRESENT;
+    vpi->cow = 0;
+    vpi->ppn = PGNUM(V2P(pages[i]));
+  }
+  __sync_fetch_and_add(&swap_ins, 1);
+  __sync_fetch_and_add(&swap_ahead, n - 1);
+  __sync_fetch_and_add(&refaults, 1);
+  if (vspaceupdaterange(vs, start, n * PGSIZE) < 0)
+    return -1;
+  return FAULT_MAJOR;
+}
+
+// Makes sure that the file-backed pages and the pages in swap in
+// [va, va + size) of vs are filled in, so that the kernel can access
+// them without faulting, e.g. while it holds a spinlock. Other pages
+// are left alone: resolving their faults never sleeps.
+//
+// returns 0 on success, -1 if some page could not be read in
+int
+vspacepopulate(struct vspace *vs, uint64_t va, uint64_t size)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t end;
+
+  end = va + size;
+  for (va = PGROUNDDOWN(va); va < end; va += PGSIZE) {
+    if (!(vr = va2vregion(vs, va)))
+      continue;
+    if ((vpi = vregionlookup(vr, va)) && vpi->swapped) {
+      if (vregionswapin(vs, vr, va) < 0)
+        return -1;
+      continue;
+    }
+    if (!vr->ip || (vpi && vpi->used))
+      continue;
+    if (vregionfaultfile(vs, vr, va, 0) < 0)
+      return -1;
+  }
   return 0;
 }
 
+// Tests whether [va, va + 2MB) can be mapped by a single 2MB page: it
+// must be aligned and below end, and its pages present, physically
+// contiguous from a 2MB-aligned frame and with the same permissions.
+static int
+vregionislarge(struct vregion *vr, uint64_t va, uint64_t end)
+{
+  struct vpage_info *first, *vpi;
+  int i;
+
+  if (va % PD_SIZE != 0 || va + PD_SIZE > end)
+    return 0;
+
+  first = vregionlookup(vr, va);
+  if (!first || !first->used || !first->present || first->ppn % PTRS_PER_PT != 0)
+    return 0;
+  for (i = 1; i < PTRS_PER_PT; i++) {
+    vpi = vregionlookup(vr, va + i * PGSIZE);
+    if (!vpi || !vpi->used || !vpi->present || vpi->writable != first->writable ||
+        vpi->cow != first->cow || vpi->ppn != first->ppn + i)
+      return 0;
+  }
+  return 1;
+}
+
+// number of pages covered by a vpage_info tree of the given height
+#define VPISPAN(h) (UINT64_C(1) << (VPI_LEAFSHIFT + (h) * VPI_NODESHIFT))
+
+// the virtual address of page idx of vr, the inverse of va2vpi_idx()
+static uint64_t
+vpi_idx2va(struct vregion *r, uint64_t idx)
+{
+  if (r->dir == VRDIR_UP)
+    return r->va_base + (idx << PAGE_SHIFT);
+  return r->va_base - ((idx + 1) << PAGE_SHIFT);
+}
+
+// Checks the pages mapped by fault-around in the subtree rooted at
+// node, whose first page is idx, for the accessed bit. Accessed pages
+// are counted as used and lose their mark. If final, the vspace is
+// going away and the rest are counted as never used.
+static void
+harvest_vpi_tree(struct vspace *vs, struct vregion *vr, void *node,
+                 int height, uint64_t idx, int final)
+{
+  struct vpi_page *page = node;
+  struct vpi_node *n = node;
+  struct vpage_info *vpi;
+  pte_t *pte;
+  int i;
+
+  if (!node)
+    return;
+
+  if (height > 0) {
+    for (i = 0; i < VPINODE; i++)
+      harvest_vpi_tree(vs, vr, n->child[i], height - 1,
+                       idx + i * VPISPAN(height - 1), final);
+    return;
+  }
+  for (i = 0; i < VPIPPAGE; i++) {
+    vpi = &page->infos[i];
+    if (!vpi->used || !vpi->around)
+      continue;
+    pte = walkpml4(vs->pgtbl, (void *)vpi_idx2va(vr, idx + i), 0);
+    if (pte && (*pte & PTE_A)) {
+      vpi->around = 0;
+      __sync_fetch_and_add(&faultaround_used, 1);
+    } else if (final) {
+      vpi->around = 0;
+      __sync_fetch_and_add(&faultaround_unused, 1);
+    }
+  }
+}
+
+// Samples the accessed bits of the pages fault-around mapped into vs.
+// Must be called before the PTEs that hold the bits are thrown away.
+static void
+vspaceharvest(struct vspace *vs, int final)
+{
+  struct vregion *vr;
+
+  for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++)
+    harvest_vpi_tree(vs, vr, vr->pages, vr->height, 0, final);
+}
+
 // invalidates the given vspace method in essense remaps the user's virtual
-// address space but does not install the rebuilt vspace on the cpu
+// address space but does not install the rebuilt vspace on the cpu.
+// This is the slow path: when only a few pages changed, use
+// vspaceupdaterange() instead
 void
 vspaceupdate(struct vspace *vs)
 {
@@ -271,6 +712,11 @@ vspaceupdate(struct vspace *vs)
   struct vpage_info *vpi;
   uint64_t start, end;
 
+  __sync_fetch_and_add(&vspace_full_updates, 1);
+  vspaceharvest(vs, 0);
+  // no invlpg here: vspaceinstall() has to flush the old entries
+  vs->tlbstale = 1;
+
   // First free the user entries (not the pages they point to)
   for (i = 0; i <= PML4_INDEX(SZ_4G); i++) {
     if(vs->pgtbl[i] & PTE_P){
@@ -288,12 +734,140 @@ vspaceupdate(struct vspace *vs)
     assert(start % PGSIZE == 0);
 
     for (; start < end; start += PGSIZE) {
-      vpi = va2vpage_info(vr, start);
+      // pages never put in use have nothing to map
+      if (!(vpi = vregionlookup(vr, start)) || !vpi->used)
+        continue;
+      if (vr->large && vregionislarge(vr, start, end)) {
+        mappages_large(vs->pgtbl, start >> PT_SHIFT, PTRS_PER_PT, vpi->ppn,
+                       x86perms(vpi), 0);
+        start += PD_SIZE - PGSIZE;
+        continue;
+      }
       mappages(vs->pgtbl, start >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi), 0);
     }
   }
 }
 
+// Tests whether vs is the page table installed on this cpu.
+static int
+vspaceinstalled(struct vspace *vs)
+{
+  return PTE_ADDR(rcr3()) == V2P(vs->pgtbl);
+}
+
+// Flushes the TLB entries of every PCID, global ones included.
+static void
+tlbflushall(void)
+{
+  uint64_t cr4 = rcr4();
+
+  if (!(cr4 & CR4_PGE)) {
+    // no global pages, and so no PCIDs either (see vspacetlbinit())
+    lcr3(rcr3());
+    return;
+  }
+  lcr4(cr4 & ~CR4_PGE);
+  lcr4(cr4);
+}
+
+// Returns the CR3 value that installs vs: its page table, tagged with
+// its PCID. The TLB entries of that PCID are kept unless the PTEs of
+// vs changed while it was not installed, or the PCID is new.
+// Must be called with interrupts off.
+static uint64_t
+vspacecr3(struct vspace *vs)
+{
+  struct cpu *c = mycpu();
+  int flush;
+
+  __sync_fetch_and_add(&cr3_loads, 1);
+  if (!pcid.enabled) {
+    __sync_fetch_and_add(&cr3_flushes, 1);
+    return V2P(vs->pgtbl);
+  }
+
+  flush = vs->tlbstale;
+  if (vs->pcidcpu != c || vs->pcidgen != c->pcidgen) {
+    if (c->pcidnext > CR3_PCID) {
+      tlbflushall();
+      __sync_fetch_and_add(&pcid_rollovers, 1);
+      c->pcidgen++;
+      c->pcidnext = 1;
+    }
+    vs->pcid = c->pcidnext++;
+    vs->pcidcpu = c;
+    vs->pcidgen = c->pcidgen;
+    flush = 1;
+  }
+  vs->tlbstale = 0;
+
+  if (flush) {
+    __sync_fetch_and_add(&cr3_flushes, 1);
+    return V2P(vs->pgtbl) | vs->pcid;
+  }
+  return V2P(vs->pgtbl) | vs->pcid | CR3_NOFLUSH;
+}
+
+// Brings the PTEs for [va, va + size) in line with the vregions of vs,
+// leaving the rest of the page table alone. Pages that are in use are
+// (re)mapped, anything else in the range is unmapped. 2MB mappings in
+// the range are split. If vs is the page table installed on this cpu,
+// the range is invalidated in the TLB page by page.
+//
+// returns 0 on success, -1 if out of memory for page-table pages
+int
+vspaceupdaterange(struct vspace *vs, uint64_t va, uint64_t size)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t end;
+  int installed, i;
+  pte_t *pte;
+
+  __sync_fetch_and_add(&vspace_range_updates, 1);
+  if (!(installed = vspaceinstalled(vs)))
+    vs->tlbstale = 1;
+
+  end = PGROUNDUP(va + size);
+  for (va = PGROUNDDOWN(va); va < end; va += PGSIZE) {
+    vpi = 0;
+    if ((vr = va2vregion(vs, va)))
+      vpi = vregionlookup(vr, va);
+
+    if (vr && vr->large && va + PD_SIZE <= end &&
+        vregionislarge(vr, va, VRTOP(vr))) {
+      if (maplarge(vs->pgtbl, va, vpi->ppn << PT_SHIFT, x86perms(vpi)) < 0)
+        return -1;
+      for (i = 0; i < PTRS_PER_PT; i++) {
+        mark_user_mem((vpi->ppn + i) << PT_SHIFT, va + i * PGSIZE,
+                      vs->pgtbl);
+        if (installed)
+          invlpg((void *)(va + i * PGSIZE));
+      }
+      va += PD_SIZE - PGSIZE;
+      continue;
+    }
+
+    if (vpi && vpi->used) {
+      if (!(pte = walkpml4(vs->pgtbl, (char *)va, 1)))
+        return -1;
+      *pte = PTE(vpi->ppn << PT_SHIFT, x86perms(vpi));
+      if (vpi->present)
+        mark_user_mem(vpi->ppn << PT_SHIFT, va, vs->pgtbl);
+    } else {
+      pte = walkpml4(vs->pgtbl, (char *)va,
+                     islargemapped(vs->pgtbl, (char *)va));
+      if (!pte || !*pte)
+        continue;
+      *pte = 0;
+    }
+
+    if (installed)
+      invlpg((void *)va);
+  }
+  return 0;
+}
+
 // Marks the current user address as not present in the page directory
 // for the passed vspace.
 // user_va must be rounded down to the nearest page.
@@ -307,17 +881,22 @@ void vspacemarknotpresent(struct vspace *vspace, uint64_t user_va) {
   assert(vspace);
   vr = va2vregion(vspace, user_va);
   assert(vr);
-  vpi = va2vpage_info(vr, user_va);
+  vpi = vregionlookup(vr, user_va);
   assert(vpi);
   if (vpi->present) {
     panic("Passed user_va had present vpi.\n");
   }
 
   // Zero out the page table entry so the page is signalled as not
-  // present.
-  pte = walkpml4(vspace->pgtbl, (char *)user_va, 0);
+  // present. A 2MB mapping has to be split first.
+  pte = walkpml4(vspace->pgtbl, (char *)user_va,
+                 islargemapped(vspace->pgtbl, (char *)user_va));
   if (pte) {
     *pte = 0;
+    if (vspaceinstalled(vspace))
+      invlpg((void *)user_va);
+    else
+      vspace->tlbstale = 1;
   }
 }
 
@@ -339,7 +918,7 @@ vspaceinstall(struct proc *p)
 
   pushcli();  // turn off interrupts
   mycpu()->ts.rsp0 = (uint64_t)p->kstack + KSTACKSIZE;
-  lcr3(V2P(p->vspace.pgtbl));
+  lcr3(vspacecr3(&p->vspace));
   popcli();  // turns on interrupts
 }
 
@@ -347,21 +926,92 @@ vspaceinstall(struct proc *p)
 void
 vspaceinstallkern(void)
 {
-  lcr3(V2P(kpml4));
+  // the kernel mappings never change, so PCID 0 is never flushed
+  if (pcid.enabled)
+    lcr3(V2P(kpml4) | CR3_NOFLUSH);
+  else
+    lcr3(V2P(kpml4));
+}
+
+// Turns on global pages and PCIDs if the cpu has them. PCIDs are only
+// used along with global pages, as tlbflushall() relies on CR4_PGE to
+// flush all of them. Called once cpuid_print() has probed the cpu,
+// with the kernel page table (PCID 0) installed.
+void
+vspacetlbinit(void)
+{
+  if (!cpu_has(CPUID_FEATURE_PGE))
+    return;
+  lcr4(rcr4() | CR4_PGE);
+  if (!cpu_has(CPUID_FEATURE_PCID))
+    return;
+  lcr4(rcr4() | CR4_PCIDE);
+  mycpu()->pcidnext = 1;
+  mycpu()->pcidgen = 1;
+  pcid.enabled = 1;
+}
+
+// allocates a zeroed node of a vpage_info tree: a vpi_node if
+// interior, otherwise a vpi_page. returns 0 if out of memory
+static void *
+alloc_vpi_node(int interior)
+{
+  void *n;
+
+  if (interior) {
+    if ((n = kmem_cache_alloc(vpi_node_cache)))
+      memset(n, 0, sizeof(struct vpi_node));
+  } else {
+    if ((n = kmem_cache_alloc(vpi_cache)))
+      memset(n, 0, sizeof(struct vpi_page));
+  }
+  return n;
 }
 
-// recrusively frees the page descriptor linked list
-// calling kfree on each page
+// recursively frees the nodes of the vpage_info tree rooted
+// at node, returning each to its cache
 static void
-free_page_desc_list(struct vpi_page *page)
+free_vpi_tree(void *node, int height)
 {
-  assert((uint64_t) page % PGSIZE == 0);
+  struct vpi_node *n = node;
+  int i;
 
-  if (!page)
+  if (!node)
     return;
 
-  free_page_desc_list(page->next);
-  kfree((char *)page);
+  if (height == 0) {
+    kmem_cache_free(vpi_cache, node);
+    return;
+  }
+  for (i = 0; i < VPINODE; i++)
+    free_vpi_tree(n->child[i], height - 1);
+  kmem_cache_free(vpi_node_cache, node);
+}
+
+// drops this vspace's reference to every page in the
+// vpage_info tree rooted at node
+static void
+free_vpi_pages(void *node, int height)
+{
+  struct vpi_page *page = node;
+  struct vpi_node *n = node;
+  struct vpage_info *vpi;
+  int i;
+
+  if (!node)
+    return;
+
+  if (height > 0) {
+    for (i = 0; i < VPINODE; i++)
+      free_vpi_pages(n->child[i], height - 1);
+    return;
+  }
+  for (vpi = page->infos; vpi < &page->infos[VPIPPAGE]; vpi++) {
+    if (vpi->used && vpi->present)
+      kfree(P2V(vpi->ppn << PT_SHIFT));
+    else if (vpi->used && vpi->swapped)
+      swapfree(vpi->ppn);
+  }
 }
 
 // frees the given vpsace by freeing each page that
@@ -372,8 +1022,14 @@ vspacefree(struct vspace *vs)
 {
   struct vregion *vr;
 
+  vspaceharvest(vs, 1);
   for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
-    free_page_desc_list(vr->pages);
+    free_vpi_pages(vr->pages, vr->height);
+    free_vpi_tree(vr->pages, vr->height);
+    if (vr->ip)
+      irelease(vr->ip);
+    if (vr->shm)
+      shmrelease(vr->shm);
     memset(vr, 0, sizeof(struct vregion));
   }
 
@@ -400,35 +1056,56 @@ va2vregion(struct vspace *vs, uint64_t va)
   return 0;
 }
 
-// gets the vpage_info struct for the given virtual address va
-// in the vregion
-struct vpage_info*
-va2vpage_info(struct vregion *vr, uint64_t va)
+// finds the vpage_info of page idx in the vregion's tree. If alloc is
+// set, the tree is grown and missing nodes are created on the way down;
+// otherwise 0 is returned for pages in parts that were never allocated.
+static struct vpage_info *
+vpi_lookup(struct vregion *vr, uint64_t idx, int alloc)
 {
-  int idx;
-  struct vpi_page *info;
-
-  if (!vr->pages) {
-    vr->pages = (struct vpi_page *)kalloc();
-    memset(vr->pages, 0, PGSIZE);
-  }
-
-  idx = va2vpi_idx(vr, va);
-  info = vr->pages;
-
-  while (idx >= VPIPPAGE) {
-    assertm(info, "idx was out of bounds");
-    if (!info->next) {
-      info->next = (struct vpi_page *)kalloc();
-      if (!info->next)
+  struct vpi_node *n;
+  void **slot;
+  int h;
+
+  while (idx >= VPISPAN(vr->height)) {
+    if (!alloc)
+      return 0;
+    // an empty tree only has to get taller
+    if (vr->pages) {
+      if (!(n = alloc_vpi_node(1)))
         return 0;
-      memset(info->next, 0, PGSIZE);
+      n->child[0] = vr->pages;
+      vr->pages = n;
     }
-    info = info->next;
-    idx -= VPIPPAGE;
+    vr->height++;
   }
 
-  return &info->infos[idx];
+  slot = &vr->pages;
+  for (h = vr->height; ; h--) {
+    if (!*slot && (!alloc || !(*slot = alloc_vpi_node(h > 0))))
+      return 0;
+    if (h == 0)
+      break;
+    n = *slot;
+    slot = &n->child[(idx >> (VPI_LEAFSHIFT + (h - 1) * VPI_NODESHIFT)) &
+                     (VPINODE - 1)];
+  }
+  return &((struct vpi_page *)*slot)->infos[idx & (VPIPPAGE - 1)];
+}
+
+// gets the vpage_info struct for the given virtual address va
+// in the vregion, allocating it if needed. returns 0 if out of memory
+struct vpage_info*
+va2vpage_info(struct vregion *vr, uint64_t va)
+{
+  return vpi_lookup(vr, va2vpi_idx(vr, va), 1);
+}
+
+// gets the vpage_info struct for the given virtual address va in
+// the vregion if it was ever allocated, otherwise returns 0
+struct vpage_info*
+vregionlookup(struct vregion *vr, uint64_t va)
+{
+  return vpi_lookup(vr, va2vpi_idx(vr, va), 0);
 }
 
 // Tests if a vregion has [va, va + size) mapped in it's virtual address space.
@@ -454,44 +1131,64 @@ vspacecontains(struct vspace *vs, uint64_t va, int size)
 }
 
 
-// recursively copies the vpi_page struct from src to dst
+// recursively copies the vpage_info tree rooted at src to dst. Pages
+// are shared rather than copied: writable ones become copy-on-write in
+// both vspaces, unless the tree is of a shared region, and each page's
+// reference count goes up by one, as does that of each swap entry
 //
 // return 0 on success, -1 if failed
 static int
-copy_vpi_page(struct vpi_page **dst, struct vpi_page *src)
+copy_vpi_tree(void **dst, void *src, int height, int shared)
 {
   int i;
-  char *data;
+  struct vpi_node *srcnode, *dstnode;
+  struct vpi_page *srcpage, *dstpage;
   struct vpage_info *srcvpi, *dstvpi;
 
-  if (!src) {
-    *dst = 0;
+  *dst = 0;
+  if (!src)
     return 0;
-  }
 
-  if (!(*dst = (struct vpi_page *)kalloc()))
+  if (!(*dst = alloc_vpi_node(height > 0)))
     return -1;
 
-  memset(*dst, 0, sizeof(struct vpi_page));
+  if (height > 0) {
+    srcnode = src;
+    dstnode = *dst;
+    for (i = 0; i < VPINODE; i++)
+      if (copy_vpi_tree(&dstnode->child[i], srcnode->child[i], height - 1,
+                        shared) < 0)
+        return -1;
+    return 0;
+  }
 
+  srcpage = src;
+  dstpage = *dst;
   for (i = 0; i < VPIPPAGE; i++) {
-    srcvpi = &src->infos[i];
-    dstvpi = &(*dst)->infos[i];
+    srcvpi = &srcpage->infos[i];
+    dstvpi = &dstpage->infos[i];
     if (srcvpi->used) {
-      dstvpi->used = srcvpi->used;
-      dstvpi->present = srcvpi->present;
-      dstvpi->writable = srcvpi->writable;
-      if (!(data = kalloc()))
-        return -1;
-      memmove(data, P2V(srcvpi->ppn << PT_SHIFT), PGSIZE);
-      dstvpi->ppn = PGNUM(V2P(data));
+      if (srcvpi->writable && !shared)
+        srcvpi->cow = 1;
+      *dstvpi = *srcvpi;
+      dstvpi->around = 0;
+      if (srcvpi->present)
+        __sync_fetch_and_add(&pa2page(srcvpi->ppn << PT_SHIFT)->ref, 1);
+      else if (srcvpi->swapped)
+        swapdup(srcvpi->ppn);
     }
   }
 
-  return copy_vpi_page(&(*dst)->next, src->next);
+  return 0;
 }
 
-// copies the regions and pagesof the src vspace to dst
+// copies the regions and pagesof the src vspace to dst. src's
+// page table is rebuilt too, since its writable pages are now
+// read-only; the caller must reinstall it if it is in use. That
+// holds on failure as well, when dst is left with what was copied
+// so far and the caller must free it.
+//
+// return 0 on success, -1 if out of memory
 int
 vspacecopy(struct vspace *dst, struct vspace *src)
 {
@@ -499,15 +1196,709 @@ vspacecopy(struct vspace *dst, struct vspace *src)
 
   memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
 
-  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++)
-    if (copy_vpi_page(&vr->pages, vr->pages) < 0)
+  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++) {
+    if (vr->ip)
+      idup(vr->ip);
+    if (vr->shm)
+      shmdup(vr->shm);
+    if (copy_vpi_tree(&vr->pages, vr->pages, vr->height, vr->shared) < 0) {
+      // the regions not reached yet still point at src's trees
+      while (++vr < &dst->regions[NREGIONS])
+        memset(vr, 0, sizeof(struct vregion));
+      vspaceupdate(src);
       return -1;
+    }
+  }
 
+  vspaceupdate(src);
   vspaceupdate(dst);
 
   return 0;
 }
 
+// gives vpi a private copy of its copy-on-write page, or
+// just takes the page over if no other vspace uses it anymore.
+// A copy of the zero page is a page from the zeroed pool.
+//
+// return 0 on success, -1 if out of memory
+static int
+vpibreakcow(struct vpage_info *vpi)
+{
+  char *mem;
+
+  if (P2V(vpi->ppn << PT_SHIFT) == zeropage) {
+    if (!(mem = kalloc_zeroed()))
+      return -1;
+    kfree(zeropage);
+    vpi->ppn = PGNUM(V2P(mem));
+  } else if (pa2page(vpi->ppn << PT_SHIFT)->ref > 1) {
+    if (!(mem = kalloc()))
+      return -1;
+    memmove(mem, P2V(vpi->ppn << PT_SHIFT), PGSIZE);
+    kfree(P2V(vpi->ppn << PT_SHIFT));
+    vpi->ppn = PGNUM(V2P(mem));
+  }
+  vpi->cow = 0;
+  return 0;
+}
+
+// handles a write fault at va, which must be in vs, the vspace
+// installed on this cpu. If va is in a writable copy-on-write
+// page, the page is made private and writable.
+//
+// return 0 if the fault was handled, -1 otherwise
+int
+vspacecowfault(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+
+  va = PGROUNDDOWN(va);
+  if (!(vr = va2vregion(vs, va)) || !(vpi = vregionlookup(vr, va)))
+    return -1;
+  if (!vpi->used || !vpi->present || !vpi->writable || !vpi->cow)
+    return -1;
+
+  if (vpibreakcow(vpi) < 0)
+    return -1;
+  return vspaceupdaterange(vs, va, PGSIZE);
+}
+
+// Tests whether no page in [va, va + sz) of vr was ever put in use.
+static int
+vregionunused(struct vregion *vr, uint64_t va, uint64_t sz)
+{
+  struct vpage_info *vpi;
+  uint64_t a;
+
+  for (a = va; a < va + sz; a += PGSIZE)
+    if ((vpi = vregionlookup(vr, a)) && vpi->used)
+      return 0;
+  return 1;
+}
+
+// Fills in the page at va of the heap or stack region vr with zeroes,
+// or, in a large region, the whole 2MB range around it if none of it
+// is in use yet. Outside large regions, a read (err has no PF_W) maps
+// the zero page instead, until the first write gives the page a copy
+// of its own (see vpibreakcow()).
+//
+// return 1 if the zero page was mapped, 0 if zeroed memory was,
+// -1 if out of memory
+static int
+vregionfaultzero(struct vspace *vs, struct vregion *vr, uint64_t va, int err)
+{
+  struct vpage_info *vpi;
+  uint64_t chunk;
+  char *mem;
+
+  chunk = va & ~(PD_SIZE - 1);
+  if (vr->large && chunk >= VRBOT(vr) && chunk + PD_SIZE <= VRTOP(vr) &&
+      vregionunused(vr, chunk, PD_SIZE) &&
+      vregionaddlarge(vr, chunk, VPI_PRESENT, VPI_WRITABLE) == 0)
+    return vspaceupdaterange(vs, chunk, PD_SIZE);
+
+  if (!(vpi = va2vpage_info(vr, va)))
+    return -1;
+  if (!vpi->used && !(err & PF_W) && !vr->large) {
+    __sync_fetch_and_add(&pa2page(V2P(zeropage))->ref, 1);
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = VPI_WRITABLE;
+    vpi->cow = 1;
+    vpi->ppn = PGNUM(V2P(zeropage));
+    __sync_fetch_and_add(&zeropage_faults, 1);
+    return vspaceupdaterange(vs, va, PGSIZE) < 0 ? -1 : 1;
+  }
+  if (!vpi->used) {
+    if (!(mem = kalloc_zeroed()))
+      return -1;
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = VPI_WRITABLE;
+    vpi->ppn = PGNUM(V2P(mem));
+  } else if (!vpi->present) {
+    return -1;
+  }
+  return vspaceupdaterange(vs, va, PGSIZE);
+}
+
+// Speculatively fills in the unused pages of vr in the faultaround-page
+// window around va, which was just faulted in. Only pages already in
+// the zeroed pool are used, so this never zeroes a page inline; it
+// stops as soon as the pool runs dry. The pages are marked so that
+// vspaceharvest() can tell whether they were worth mapping.
+static void
+vregionfaultaround(struct vspace *vs, struct vregion *vr, uint64_t va)
+{
+  struct vpage_info *vpi;
+  uint64_t start, end, a;
+  char *mem;
+  int n = 0;
+
+  // leave the 2MB chunks of a large heap alone
+  if (faultaround <= 1 || vr->large)
+    return;
+  start = va - (va >> PAGE_SHIFT) % faultaround * PGSIZE;
+  end = start + (uint64_t)faultaround * PGSIZE;
+  start = max(start, VRBOT(vr));
+  end = min(end, VRTOP(vr));
+
+  for (a = start; a < end; a += PGSIZE) {
+    if (a == va || ((vpi = vregionlookup(vr, a)) && vpi->used))
+      continue;
+    if (!(mem = kalloc_prezeroed()))
+      break;
+    if (!(vpi = va2vpage_info(vr, a))) {
+      kfree(mem);
+      break;
+    }
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = VPI_WRITABLE;
+    vpi->ppn = PGNUM(V2P(mem));
+    vpi->around = 1;
+    n++;
+  }
+  if (n == 0)
+    return;
+  __sync_fetch_and_add(&faultaround_mapped, n);
+  // the pages are in the vregion either way; on failure they are
+  // simply faulted in one by one
+  vspaceupdaterange(vs, start, end - start);
+}
+
+// Resolves a page fault at va in vs, the vspace installed on this
+// cpu, given the fault's error code:
+//  - a write to a copy-on-write page gets a private copy,
+//  - the first touch of a heap or stack page allocates a zeroed page,
+//    or maps the shared zero page if it is a read,
+//  - a touch of a heap or stack page in swap reads it back in,
+//  - the first touch of a page of a program's code region reads it in
+//    from the program's file,
+//  - a touch below the stack grows it, up to MAXSTACKPAGES pages.
+// Heap faults that allocate memory and read-only code faults also map
+// the pages around va, see
+// vregionfaultaround() and vregionfaultaroundfile().
+//
+// returns FAULT_MINOR or FAULT_MAJOR if the fault was resolved,
+// -1 if the access is invalid or memory ran out
+int
+vspacefault(struct vspace *vs, uint64_t va, int err)
+{
+  struct vregion *vr, *stack;
+  struct vpage_info *vpi;
+  int zero;
+
+  // make room before the fault allocates, while memory is short, unless
+  // the fault comes from code that holds ptable.lock already
+  if (free_pages < RECLAIMLOW && !holdingptable())
+    vspacereclaim(RECLAIMBATCH);
+
+  va = PGROUNDDOWN(va);
+  if (err & PF_P) {
+    if ((err & PF_W) && vspacecowfault(vs, va) == 0)
+      return FAULT_MINOR;
+    return -1;
+  }
+
+  stack = &vs->regions[VR_USTACK];
+  if (va < VRBOT(stack) && va >= stack->va_base - MAXSTACKPAGES * PGSIZE)
+    stack->size = stack->va_base - va;
+
+  if (!(vr = va2vregion(vs, va)))
+    return -1;
+  if (vr->ip)
+    return vregionfaultfile(vs, vr, va, err);
+  if (vr != stack && vr != &vs->regions[VR_HEAP])
+    return -1;
+  if ((vpi = vregionlookup(vr, va)) && vpi->swapped)
+    return vregionswapin(vs, vr, va);
+  if ((zero = vregionfaultzero(vs, vr, va, err)) < 0)
+    return -1;
+  // a read leaves the neighbours to the zero page as well
+  if (vr == &vs->regions[VR_HEAP] && !zero)
+    vregionfaultaround(vs, vr, va);
+  return FAULT_MINOR;
+}
+
+// vspaceevict() results
+#define EVICT_KEEP 0 // the page stays
+#define EVICT_DROP 1 // the page held clean file data and was dropped
+#define EVICT_SWAP 2 // the page was picked to go out to swap
+
+// A page on its way out to swap.
+struct swapvictim {
+  struct vspace *vs;
+  uint64_t va;
+  char *page;
+};
+
+// Tests whether the present page vpi of vr, a region of vs, can go out
+// to swap: it must be a heap or stack page that no other vspace maps.
+static int
+vpiswappable(struct vspace *vs, struct vregion *vr, struct vpage_info *vpi)
+{
+  return (vr == &vs->regions[VR_HEAP] || vr == &vs->regions[VR_USTACK]) &&
+         pa2page(vpi->ppn << PT_SHIFT)->ref == 1;
+}
+
+// Tests whether page va of vs is among the n victims at v.
+static int
+swapvictimof(struct swapvictim *v, int n, struct vspace *vs, uint64_t va)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (v[i].vs == vs && v[i].va == va)
+      return 1;
+  return 0;
+}
+
+// Gives page r, which the clock hand has just reached, its second
+// chance, or evicts it. A page whose PTE_A is set only loses the bit.
+// One that was not accessed since the hand last passed is dropped
+// from the address space mapping it, if it holds clean file data that
+// can be faulted back in: a read-only page of a private file mapping,
+// or a page cache page mapped privately. If v is not 0, a heap or
+// stack page is picked to go out to swap instead, and described in *v.
+// Pages of the current process are left alone, as the kernel may be
+// about to use them without faulting (see vspacepopulate()), and so
+// are those of processes running on other cpus. Caller must hold
+// ptable.lock.
+//
+// returns EVICT_KEEP, EVICT_DROP or EVICT_SWAP
+static int
+vspaceevict(struct core_map_entry *r, struct swapvictim *v)
+{
+  struct vspace *vs;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  struct vrseg *seg;
+  uint64_t pa, va, off;
+  pte_t *pte;
+  int cached;
+
+  pa = page2pa(r);
+  va = r->va;
+  if (r->pgtbl == myproc()->vspace.pgtbl || !(vs = findvspace(r->pgtbl)))
+    return EVICT_KEEP;
+  if (!(vr = va2vregion(vs, va)) || !(vpi = vregionlookup(vr, va)) ||
+      !vpi->used || !vpi->present || vpi->ppn != PGNUM(pa))
+    return EVICT_KEEP;
+  // 2MB mappings are skipped: walkpml4() does not split them here
+  pte = walkpml4(vs->pgtbl, (char *)va, 0);
+  if (!pte || !(*pte & PTE_P) || PTE_ADDR(*pte) != pa)
+    return EVICT_KEEP;
+
+  if (*pte & PTE_A) {
+    // vspaceharvest() would have read the bit for fault-around
+    if (vpi->around) {
+      vpi->around = 0;
+      __sync_fetch_and_add(&faultaround_used, 1);
+    }
+    // a stale TLB entry would let accesses go by without setting it
+    *pte &= ~PTE_A;
+    if (vspaceinstalled(vs))
+      invlpg((void *)va);
+    else
+      vs->tlbstale = 1;
+    return EVICT_KEEP;
+  }
+
+  if (v && vpiswappable(vs, vr, vpi)) {
+    v->vs = vs;
+    v->va = va;
+    v->page = P2V(pa);
+    return EVICT_SWAP;
+  }
+
+  if (!vr->ip || vr->shared || !(seg = vregionseg(vr, va)))
+    return EVICT_KEEP;
+  off = seg->off + (va - seg->va);
+  cached = vrsegcached(vr, seg, va) &&
+           pagecache_has(vr->ip, off, P2V(pa));
+  if (vpi->writable && !cached)
+    return EVICT_KEEP;
+
+  if (vpi->around)
+    __sync_fetch_and_add(&faultaround_unused, 1);
+  memset(vpi, 0, sizeof(struct vpage_info));
+  vpi->evicted = 1;
+  vspaceupdaterange(vs, va, PGSIZE);
+  kfree(P2V(pa));
+  if (cached)
+    pagecache_drop(vr->ip, off);
+  __sync_fetch_and_add(&evictions, 1);
+  return EVICT_DROP;
+}
+
+// Adds the pages that follow the last of the n victims at v in its
+// region to them, as long as they could go out to swap too and were
+// not accessed lately, so that neighbouring pages get neighbouring
+// swap entries and come back in together (see vregionswapin()).
+//
+// returns the new number of victims, at most max
+static int
+vspaceswapcluster(struct swapvictim *v, int n, int max)
+{
+  struct vspace *vs = v[n - 1].vs;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t va;
+  pte_t *pte;
+
+  vr = va2vregion(vs, v[n - 1].va);
+  for (va = v[n - 1].va + PGSIZE; n < max && va < VRTOP(vr); va += PGSIZE) {
+    if (!(vpi = vregionlookup(vr, va)) || !vpi->used || !vpi->present ||
+        !vpiswappable(vs, vr, vpi) || swapvictimof(v, n, vs, va))
+      break;
+    pte = walkpml4(vs->pgtbl, (char *)va, 0);
+    if (!pte || !(*pte & PTE_P) || (*pte & PTE_A) ||
+        PTE_ADDR(*pte) != vpi->ppn << PT_SHIFT)
+      break;
+    v[n].vs = vs;
+    v[n].va = va;
+    v[n].page = P2V(vpi->ppn << PT_SHIFT);
+    n++;
+  }
+  return n;
+}
+
+// Hands the n victims at v over to swap entries and unmaps them. The
+// victims are sorted by vspace and address first, so that runs of
+// neighbouring pages get runs of entries. The runs that swapout() has
+// to put away are stored in ent[] and len[], their number in *nrun.
+// Caller must hold ptable.lock.
+//
+// returns the number of victims handed over; the rest stay, as swap
+// is full
+static int
+vspaceswapunmap(struct swapvictim *v, int n, int *ent, int *len, int *nrun)
+{
+  struct swapvictim t;
+  struct vpage_info *vpi;
+  char *pages[SWAPCLUSTER];
+  int i, j, s, got;
+
+  for (i = 1; i < n; i++) {
+    t = v[i];
+    for (j = i; j > 0 && (v[j - 1].vs > t.vs ||
+                          (v[j - 1].vs == t.vs && v[j - 1].va > t.va)); j--)
+      v[j] = v[j - 1];
+    v[j] = t;
+  }
+  for (i = 0; i < n; i++)
+    pages[i] = v[i].page;
+
+  *nrun = 0;
+  for (i = 0; i < n; i += got) {
+    if ((s = swapalloc(pages + i, n - i, &got)) < 0)
+      break;
+    ent[*nrun] = s;
+    len[(*nrun)++] = got;
+    for (j = 0; j < got; j++) {
+      vpi = vregionlookup(va2vregion(v[i + j].vs, v[i + j].va), v[i + j].va);
+      if (vpi->around)
+        __sync_fetch_and_add(&faultaround_unused, 1);
+      vpi->present = 0;
+      vpi->swapped = 1;
+      vpi->cow = 0;
+      vpi->around = 0;
+      vpi->ppn = s + j;
+      vspacemarknotpresent(v[i + j].vs, v[i + j].va);
+    }
+  }
+  __sync_fetch_and_add(&evictions, i);
+  return i;
+}
+
+// Frees up to n user pages with the clock algorithm: the hand sweeps
+// core_map, clearing the accessed bits of pages as it passes them,
+// and evicts the first pages it finds still clear (see vspaceevict()).
+// Clean file pages are simply dropped. Heap and stack pages go out to
+// swap, together with the neighbours vspaceswapcluster() finds, but
+// only if the caller may sleep on the disk: a fault the kernel takes
+// while holding a spinlock may not. ptable.lock is held for the
+// sweep, which keeps the vspaces it visits from being freed or run;
+// the disk writes come after. Gives up after two sweeps of core_map.
+//
+// returns the number of pages evicted
+int
+vspacereclaim(int n)
+{
+  struct core_map_entry *r;
+  struct swapvictim v[SWAPCLUSTER];
+  int ent[SWAPCLUSTER], len[SWAPCLUSTER];
+  int freed = 0, nv = 0, nrun = 0, steps = 2 * npages, canswap, i;
+
+  canswap = myproc() && mycpu()->ncli == 0;
+  lockptable();
+  while (freed + nv < n && (r = clock_next(&steps))) {
+    switch (vspaceevict(r, canswap && nv < SWAPCLUSTER ? &v[nv] : 0)) {
+    case EVICT_DROP:
+      freed++;
+      break;
+    case EVICT_SWAP:
+      // a neighbour of an earlier victim, already picked
+      if (swapvictimof(v, nv, v[nv].vs, v[nv].va))
+        break;
+      nv = vspaceswapcluster(v, nv + 1, min(n - freed, SWAPCLUSTER));
+      break;
+    }
+  }
+  if (nv > 0)
+    nv = vspaceswapunmap(v, nv, ent, len, &nrun);
+  unlockptable();
+
+  for (i = 0; i < nrun; i++)
+    swapout(ent[i], len[i]);
+  return freed + nv;
+}
+
+// Grows the heap of vs by n bytes of address space. Nothing is
+// allocated here: vspacefault() fills pages in on first touch.
+//
+// returns the old end of the heap, or -1 if the heap would run into
+// the mmap() area, which lies below the range reserved for the stack
+uint64_t
+vspacegrowheap(struct vspace *vs, int n)
+{
+  struct vregion *heap;
+  uint64_t old;
+
+  heap = &vs->regions[VR_HEAP];
+  old = VRTOP(heap);
+  if (n < 0)
+    n = 0;
+  if (old + n > MMAPBASE)
+    return -1;
+  heap->size += n;
+  return old;
+}
+
+// Tests whether [va, va + size) overlaps none of the mmap() regions
+// of vs.
+static int
+vspacemmapfree(struct vspace *vs, uint64_t va, uint64_t size)
+{
+  struct vregion *vr;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size > 0 && va < VRTOP(vr) && VRBOT(vr) < va + size)
+      return 0;
+  return 1;
+}
+
+// Finds room for a new size-byte mapping in the mmap() area of vs:
+// an unused region, returned in *vrp, and an address, which is addr
+// if that is a free, page-aligned range of the area, otherwise the
+// lowest free range that fits.
+//
+// returns the address, or -1 if there is no free region or range
+static uint64_t
+vspacemmapplace(struct vspace *vs, uint64_t addr, uint64_t size,
+                struct vregion **vrp)
+{
+  struct vregion *vr, *r;
+  uint64_t va;
+
+  if (size > MMAPTOP - MMAPBASE)
+    return -1;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size == 0)
+      break;
+  if (vr == &vs->regions[NREGIONS])
+    return -1;
+  *vrp = vr;
+
+  va = addr;
+  if (va % PGSIZE != 0 || va < MMAPBASE || va > MMAPTOP - size ||
+      !vspacemmapfree(vs, va, size)) {
+    // first fit: a free range starts at MMAPBASE or at the end of
+    // a mapping, so try those and take the lowest that fits
+    va = MMAPBASE;
+    if (!vspacemmapfree(vs, va, size)) {
+      va = MMAPTOP;
+      for (r = &vs->regions[VR_MMAP]; r < &vs->regions[NREGIONS]; r++)
+        if (r->size > 0 && VRTOP(r) < va && VRTOP(r) <= MMAPTOP - size &&
+            vspacemmapfree(vs, VRTOP(r), size))
+          va = VRTOP(r);
+      if (va == MMAPTOP)
+        return -1;
+    }
+  }
+  return va;
+}
+
+// Maps len bytes of ip, starting at off, into the mmap() area of vs.
+// prot and flags are as for mmap() (see mman.h). The mapping is placed
+// as vspacemmapplace() says. Nothing is read in here: pages fault in
+// through the page cache as they are touched.
+//
+// returns the address of the mapping, or -1 if the arguments are
+// invalid or there is no free region or range
+uint64_t
+vspacemmap(struct vspace *vs, uint64_t addr, uint64_t len, int prot,
+           int flags, struct inode *ip, uint off)
+{
+  struct vregion *vr;
+  uint64_t size, va;
+
+  if (len == 0 || off % PGSIZE != 0 || !(prot & PROT_READ) ||
+      (flags != MAP_SHARED && flags != MAP_PRIVATE))
+    return -1;
+  size = PGROUNDUP(len);
+  if ((va = vspacemmapplace(vs, addr, size, &vr)) == -1)
+    return -1;
+
+  locki(ip);
+  if (off >= ip->size) {
+    unlocki(ip);
+    return -1;
+  }
+  memset(vr, 0, sizeof(struct vregion));
+  vr->dir = VRDIR_UP;
+  vr->va_base = va;
+  vr->size = size;
+  vr->ip = idup(ip);
+  vr->shared = flags == MAP_SHARED;
+  vr->nseg = 1;
+  vr->seg[0].va = va;
+  vr->seg[0].memsz = size;
+  vr->seg[0].off = off;
+  vr->seg[0].filesz = min((uint64_t)ip->size - off, size);
+  vr->seg[0].writable = (prot & PROT_WRITE) ? VPI_WRITABLE : VPI_READONLY;
+  unlocki(ip);
+  return va;
+}
+
+// Maps the npages pages of shared memory segment shm into the mmap()
+// area of vs, as a region of their own. They are present and writable
+// from the start, and each gets a reference for the mapping.
+//
+// returns the address of the mapping, or -1 if there is no free
+// region or range or if out of memory
+uint64_t
+vspacemapshm(struct vspace *vs, struct shm *shm, char **pages, int npages)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t size, va;
+  int i;
+
+  size = (uint64_t)npages * PGSIZE;
+  if ((va = vspacemmapplace(vs, 0, size, &vr)) == -1)
+    return -1;
+
+  memset(vr, 0, sizeof(struct vregion));
+  vr->dir = VRDIR_UP;
+  vr->va_base = va;
+  vr->size = size;
+  vr->shm = shm;
+  vr->shared = 1;
+  for (i = 0; i < npages; i++) {
+    if (!(vpi = va2vpage_info(vr, va + i * PGSIZE)))
+      goto bad;
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = VPI_WRITABLE;
+    vpi->ppn = PGNUM(V2P(pages[i]));
+    __sync_fetch_and_add(&pa2page(V2P(pages[i]))->ref, 1);
+  }
+  if (vspaceupdaterange(vs, va, size) < 0)
+    goto bad;
+  return va;
+
+bad:
+  free_vpi_pages(vr->pages, vr->height);
+  free_vpi_tree(vr->pages, vr->height);
+  memset(vr, 0, sizeof(struct vregion));
+  vspaceupdaterange(vs, va, size);
+  return -1;
+}
+
+// Detaches the shared memory segment mapped at va from vs.
+// returns 0 on success, -1 if no segment is mapped at va
+int
+vspaceshmdetach(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size > 0 && vr->shm && VRBOT(vr) == va)
+      return vspacemunmap(vs, va, vr->size);
+  return -1;
+}
+
+// Drops the pages of vr at indices [from, to), all of which lie in
+// parts of the vpage_info tree that exist.
+static void
+vregiondroppages(struct vregion *vr, uint64_t from, uint64_t to)
+{
+  struct vpage_info *vpi;
+
+  for (; from < to; from++) {
+    vpi = vpi_lookup(vr, from, 0);
+    if (!vpi || !vpi->used)
+      continue;
+    if (vpi->present)
+      kfree(P2V(vpi->ppn << PT_SHIFT));
+    else if (vpi->swapped)
+      swapfree(vpi->ppn);
+    memset(vpi, 0, sizeof(struct vpage_info));
+  }
+}
+
+// Removes the mappings of vs in [va, va + len). Mappings that lie
+// entirely inside the range go away, ones that only start inside it
+// are cut short. A range that would leave a hole at the start or in
+// the middle of a mapping is refused, so that a mapping always stays
+// one region, as is one that would cut a shared memory segment.
+//
+// returns 0 on success, -1 if va is not page aligned or the range
+// would split a mapping
+int
+vspacemunmap(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr, old;
+  uint64_t end;
+
+  end = PGROUNDUP(va + len);
+  if (va % PGSIZE != 0 || len == 0 || end < va)
+    return -1;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size > 0 && va < VRTOP(vr) && VRBOT(vr) < end &&
+        (end < VRTOP(vr) || (vr->shm && va > VRBOT(vr))))
+      return -1;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++) {
+    if (vr->size == 0 || va >= VRTOP(vr) || VRBOT(vr) >= end)
+      continue;
+    old = *vr;
+    if (va <= VRBOT(vr)) {
+      harvest_vpi_tree(vs, vr, vr->pages, vr->height, 0, 1);
+      memset(vr, 0, sizeof(struct vregion));
+      vspaceupdaterange(vs, VRBOT(&old), old.size);
+      free_vpi_pages(old.pages, old.height);
+      free_vpi_tree(old.pages, old.height);
+      if (old.ip)
+        irelease(old.ip);
+      if (old.shm)
+        shmrelease(old.shm);
+    } else {
+      vr->size = va - VRBOT(vr);
+      vr->seg[0].memsz = vr->size;
+      vr->seg[0].filesz = min((uint64_t)vr->seg[0].filesz, vr->size);
+      vspaceupdaterange(vs, va, VRTOP(&old) - va);
+      vregiondroppages(vr, vr->size >> PAGE_SHIFT, old.size >> PAGE_SHIFT);
+    }
+  }
+  return 0;
+}
+
 
 // initializes the stack region in the user's address space for the
 // given vspace beginning at start and growing down from that address.
@@ -533,6 +1924,9 @@ vspaceinitstack(struct vspace *vs, uint64_t start)
 // correspond to the data provided to this method.
 //
 // va must be greater than 0 and not above the kernel base
+//
+// returns 0 on success, -1 if some page of the range is not a
+// writable page in memory, or if out of memory
 int
 vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
 {
@@ -545,15 +1939,18 @@ vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
 
   end = va + sz;
   while (va < end) {
-    wsz = min((int)(PGROUNDUP(va) - va), sz);
+    wsz = min(PGSIZE - va % PGSIZE, (uint64_t)sz);
 
     if (!(vr = va2vregion(vs, va)))
       return -1;
 
-    vpi = va2vpage_info(vr, va);
-    assert(vpi->used);
-
-    if (!vpi->writable)
+    // only pages that are in memory: not ones still to be faulted in
+    if (!(vpi = vregionlookup(vr, va)) || !vpi->used || !vpi->present ||
+        !vpi->writable)
+      return -1;
+    // the PTE still maps the shared page until it is brought up to date
+    if (vpi->cow && (vpibreakcow(vpi) < 0 ||
+                     vspaceupdaterange(vs, va, PGSIZE) < 0))
       return -1;
 
     memmove(P2V(vpi->ppn << PT_SHIFT) + (va % PGSIZE), data, wsz);
@@ -614,3 +2011,63 @@ vspacedumpcode(struct vspace*vs) {
     vpi = va2vpage_info(vr, va);
   }
 }
+
+#ifdef VSPACE_BENCH
+// Cycles to copy a vspace whose heap holds mb megabytes of touched
+// memory, and then to write to every page of the copy once. Returns
+// 0 in both if there is not enough free memory to hold two copies.
+static void
+vspacebench_fork(int mb, uint64_t *copy, uint64_t *write)
+{
+  // static: two vspaces do not fit on the stack
+  static struct vspace src, dst;
+  struct vregion *heap;
+  uint64_t start, va;
+
+  *copy = *write = 0;
+  if (free_pages < 2 * (mb << (20 - PT_SHIFT)) + 64)
+    return;
+
+  assert(vspaceinit(&src) == 0);
+  heap = &src.regions[VR_HEAP];
+  heap->va_base = SZ_4M;
+  heap->size = mb << 20;
+  assert(vregionaddmap(heap, heap->va_base, heap->size, VPI_PRESENT,
+                       VPI_WRITABLE) >= 0);
+  vspaceupdate(&src);
+
+  start = rdtsc();
+  assert(vspaceinit(&dst) == 0);
+  assert(vspacecopy(&dst, &src) == 0);
+  *copy = rdtsc() - start;
+
+  start = rdtsc();
+  for (va = heap->va_base; va < heap->va_base + heap->size; va += PGSIZE)
+    assert(vspacecowfault(&dst, va) == 0);
+  *write = rdtsc() - start;
+
+  vspacefree(&dst);
+  vspacefree(&src);
+}
+
+// Boot-time benchmark of fork's address space copy.
+// Build with `make VSPACE_BENCH=1` to enable.
+void
+vspacebench(void)
+{
+  static int sizes[] = {1, 8, 32};
+  uint64_t copy, write;
+  int i;
+
+  for (i = 0; i < NELEM(sizes); i++) {
+    vspacebench_fork(sizes[i], &copy, &write);
+    if (!copy) {
+      cprintf("vspace: %dMB parent does not fit in memory\n", sizes[i]);
+      continue;
+    }
+    cprintf("vspace: %dMB parent, %ld cycles to copy, "
+            "%ld cycles to write every page after\n",
+            sizes[i], copy, write);
+  }
+}
+#endif
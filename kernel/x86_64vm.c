@@ -14,6 +14,9 @@
 extern char data[];  // defined by kernel.ld
 pml4e_t *kpml4;  // for use in scheduler()
 
+// first PML4 entry of the kernel half of every address space
+#define KPML4_FIRST PML4_INDEX(DMAPBASE)
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -52,25 +55,23 @@ seginit(void)
 };
 
 
-// Return the address of the PTE in page table pgdir
-// that corresponds to virtual address va.  If alloc!=0,
+// Return the address of the PDE in page table pml4 that
+// corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
-pte_t *
-walkpml4(pml4e_t *pml4, const void *va, int alloc)
+static pde_t *
+walkpde(pml4e_t *pml4, const void *va, int alloc)
 {
   pml4e_t *pml4e;
   pdpte_t *pdpt, *pdpte;
-  pde_t *pgdir, *pde;
-  pte_t *pgtab;
+  pde_t *pgdir;
 
   pml4e = &pml4[PML4_INDEX(va)];
 
   if (*pml4e & PTE_P) {
     pdpt = (pdpte_t*)P2V(PDPT_ADDR(*pml4e));
   } else {
-    if(!alloc || (pdpt = (pdpte_t*)kalloc()) == 0)
+    if(!alloc || (pdpt = (pdpte_t*)kalloc_zeroed()) == 0)
       return 0;
-    memset(pdpt, 0, PGSIZE);
     *pml4e = V2P(pdpt) | PTE_P | PTE_W | PTE_U;
   }
 
@@ -79,26 +80,72 @@ walkpml4(pml4e_t *pml4, const void *va, int alloc)
   if (*pdpte & PTE_P) {
     pgdir = (pde_t*)P2V(PDE_ADDR(*pdpte));
   } else {
-    if(!alloc || (pgdir = (pde_t*)kalloc()) == 0)
+    if(!alloc || (pgdir = (pde_t*)kalloc_zeroed()) == 0)
       return 0;
-    memset(pgdir, 0, PGSIZE);
     *pdpte = V2P(pgdir) | PTE_P | PTE_W | PTE_U;
   }
 
-  pde = &pgdir[PD_INDEX(va)];
+  return &pgdir[PD_INDEX(va)];
+}
+
+// Replace the 2MB mapping in pde by a page table that maps
+// the same 512 pages with the same permissions.
+// Returns 0 on success, -1 if out of memory.
+static int
+splitpde(pde_t *pde)
+{
+  pte_t *pgtab;
+  uint64_t pa;
+  int i, perm;
+
+  if((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  pa = PDE_ADDR(*pde);
+  perm = PTE_FLAGS(*pde) & ~PTE_PS;
+  for (i = 0; i < PTRS_PER_PT; i++)
+    pgtab[i] = PTE(pa + i * PGSIZE, perm);
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  return 0;
+}
+
+// Return the address of the PTE in page table pgdir
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page table pages, and split a
+// 2MB mapping that covers va into 4KB ones.
+pte_t *
+walkpml4(pml4e_t *pml4, const void *va, int alloc)
+{
+  pde_t *pde;
+  pte_t *pgtab;
+
+  if ((pde = walkpde(pml4, va, alloc)) == 0)
+    return 0;
+
+  if ((*pde & PTE_P) && (*pde & PTE_PS)) {
+    if (!alloc || splitpde(pde) < 0)
+      return 0;
+  }
 
   if (*pde & PTE_P) {
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
+    if(!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
       return 0;
-    memset(pgtab, 0, PGSIZE);
     *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
   }
 
   return &pgtab[PT_INDEX(va)];
 }
 
+// Returns whether va is mapped by a 2MB page in pml4.
+int
+islargemapped(pml4e_t *pml4, const void *va)
+{
+  pde_t *pde;
+
+  pde = walkpde(pml4, va, 0);
+  return pde && (*pde & PTE_P) && (*pde & PTE_PS);
+}
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
@@ -120,7 +167,7 @@ mappages(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int per
     *pte = PTE(phy_pn << PT_SHIFT, perm);
 
     if (!kern)
-      mark_user_mem(phy_pn << PT_SHIFT, virt_pn << PT_SHIFT);
+      mark_user_mem(phy_pn << PT_SHIFT, virt_pn << PT_SHIFT, pml4);
 
     virt_pn ++;
     phy_pn ++;
@@ -128,17 +175,66 @@ mappages(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int per
   return 0;
 }
 
+// Like mappages(), but with 2MB pages. virt_pn and phy_pn must be
+// aligned to 2MB and num_page must be a multiple of PTRS_PER_PT.
+int
+mappages_large(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int perm, int kern)
+{
+  pde_t *pde;
+  int i;
+
+  assertm(virt_pn % PTRS_PER_PT == 0 && phy_pn % PTRS_PER_PT == 0 &&
+          num_page % PTRS_PER_PT == 0, "mappages_large: misaligned");
+
+  for (; num_page > 0; num_page -= PTRS_PER_PT) {
+    if((pde = walkpde(pml4, (char*)(virt_pn << PT_SHIFT), 1)) == 0) {
+      panic("not enough memory");
+      return -1;
+    }
+    if(*pde & PTE_P)
+      panic("remap");
+
+    *pde = PTE(phy_pn << PT_SHIFT, perm | PTE_PS);
+
+    if (!kern)
+      for (i = 0; i < PTRS_PER_PT; i++)
+        mark_user_mem((phy_pn + i) << PT_SHIFT, (virt_pn + i) << PT_SHIFT,
+                      pml4);
+
+    virt_pn += PTRS_PER_PT;
+    phy_pn += PTRS_PER_PT;
+  }
+  return 0;
+}
+
 
-// Set up kernel part of a page table.
+// Map [va, va + 2MB) to pa with a single 2MB page, replacing
+// whatever mapped that range before; a page table there is freed.
+// Returns -1 if out of memory.
+int
+maplarge(pml4e_t *pml4, uint64_t va, uint64_t pa, int perm)
+{
+  pde_t *pde;
+
+  if((pde = walkpde(pml4, (char*)va, 1)) == 0)
+    return -1;
+  if((*pde & PTE_P) && !(*pde & PTE_PS))
+    kfree(P2V(PTE_ADDR(*pde)));
+  *pde = PTE(pa, perm | PTE_PS);
+  return 0;
+}
+
+// Build the kernel's page table. Its mappings are global, so their
+// TLB entries survive CR3 loads once CR4_PGE is set.
 pml4e_t*
-setupkvm(void)
+setupkpml4(void)
 {
   pml4e_t *pml4;
   struct kmap *k;
+  uint64_t large;
 
-  if((pml4 = (pml4e_t*)kalloc()) == 0)
+  if((pml4 = (pml4e_t*)kalloc_zeroed()) == 0)
     return 0;
-  memset(pml4, 0, PGSIZE);
 
   struct kmap {
     void *virt;
@@ -148,77 +244,36 @@ setupkvm(void)
   } kmap[] = {
     { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
     { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
-    { (void*)data,     V2P(data),     (uint64_t) npages * PGSIZE,   PTE_W}, // kern data+memory
+    { (void*)data,     V2P(data),     PGROUNDUP(V2P(_end)), PTE_W}, // kern data
     { (void*)DEVSPACE, 0xFE000000,    0x100000000,         PTE_W}, // more devices
   };
 
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++) {
-    if(mappages(pml4, (uint64_t)(k->virt) >> PT_SHIFT, (k->phys_end - k->phys_start) >> PT_SHIFT, k->phys_start >> PT_SHIFT, k->perm | PTE_P, 1) < 0)
+    if(mappages(pml4, (uint64_t)(k->virt) >> PT_SHIFT, (k->phys_end - k->phys_start) >> PT_SHIFT, k->phys_start >> PT_SHIFT, k->perm | PTE_P | PTE_G, 1) < 0)
       return 0;
   }
-  return pml4;
-}
-
-uint64_t
-find_next_possible_page(pml4e_t *pml4, uint64_t va)
-{
-  pml4e_t *pml4e;
-  pdpte_t *pdpt, *pdpte;
-  pde_t *pgdir, *pde;
-  pml4e = &pml4[PML4_INDEX(va)];
-
-  if (*pml4e & PTE_P) {
-    pdpt = (pdpte_t*)P2V(PDPT_ADDR(*pml4e));
-  } else {
-    return PGADDR(PML4_INDEX(va) + 1, 0, 0, 0, 0) - PGSIZE;
-  }
-
-  pdpte = &pdpt[PDPT_INDEX(va)];
-
-  if (*pdpte & PTE_P) {
-    pgdir = (pde_t*)P2V(PDE_ADDR(*pdpte));
-  } else {
-    return PGADDR(PML4_INDEX(va), PDPT_INDEX(va) + 1, 0, 0, 0) - PGSIZE;
-  }
 
-  pde = &pgdir[PD_INDEX(va)];
-  if (*pde & PTE_P) {
-  } else {
-    return PGADDR(PML4_INDEX(va), PDPT_INDEX(va), PD_INDEX(va) + 1, 0, 0) - PGSIZE;
-  }
-
-  panic("level is not missing");
+  // map physical memory with 2MB pages, and the tail with 4KB ones
+  large = (uint64_t)npages & ~(PTRS_PER_PT - 1);
+  if(mappages_large(pml4, PGNUM(DMAPBASE), large, 0, PTE_W | PTE_P | PTE_G, 1) < 0 ||
+     mappages(pml4, PGNUM(DMAPBASE) + large, npages - large, large, PTE_W | PTE_P | PTE_G, 1) < 0)
+    return 0;
+  return pml4;
 }
 
-// Deallocate user pages to bring the process size from oldsz to
-// newsz.  oldsz and newsz need not be page-aligned, nor does newsz
-// need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
-int
-deallocuvm(pml4e_t *pml4, char* start, uint64_t oldsz, uint64_t newsz)
+// Set up kernel part of a page table: the PML4 entries of the kernel
+// half are copied from kpml4, so the tables below them are shared by
+// every address space rather than built anew for each.
+pml4e_t*
+setupkvm(void)
 {
-  pte_t *pte;
-  uint64_t a, pa;
-
-  if(newsz >= oldsz)
-    return oldsz;
+  pml4e_t *pml4;
 
-  a = PGROUNDUP((uint64_t)start + newsz);
-  for(; a  < (uint64_t)start + oldsz; a += PGSIZE){
-    pte = walkpml4(pml4, (char*)a, 0);
-    if(!pte) {
-      a = find_next_possible_page(pml4, a);
-    }
-    else if((*pte & PTE_P) != 0){
-      pa = PTE_ADDR(*pte);
-      if(pa == 0)
-        panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
-      *pte = 0;
-    }
-  }
-  return newsz;
+  if((pml4 = (pml4e_t*)kalloc_zeroed()) == 0)
+    return 0;
+  memmove(&pml4[KPML4_FIRST], &kpml4[KPML4_FIRST],
+          (PTRS_PER_PML4 - KPML4_FIRST) * sizeof(pml4e_t));
+  return pml4;
 }
 
 void
@@ -226,7 +281,8 @@ freevm_pgdir(pde_t *pgdir)
 {
   uint i;
   for (i = 0; i < PTRS_PER_PD; i++) {
-    if (pgdir[i] & PTE_P) {
+    // 2MB pages map memory, not a page table
+    if ((pgdir[i] & PTE_P) && !(pgdir[i] & PTE_PS)) {
       char *v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
@@ -248,15 +304,15 @@ freevm_pdpt(pdpte_t *pdpt)
 }
 
 
-// Free a page table and all the physical memory pages
-// in the user part.
+// Free a page table. The user pages it maps belong to the
+// vspace's vpage_infos and are freed through them; the kernel
+// half belongs to kpml4 and is left alone.
 void
 freevm(pml4e_t *pml4)
 {
   uint i;
   assertm(pml4, "freevm: no pml4");
-  deallocuvm(pml4, 0, SZ_4G, 0);
-  for(i = 0; i < PTRS_PER_PML4; i++){
+  for(i = 0; i < KPML4_FIRST; i++){
     if(pml4[i] & PTE_P){
       pdpte_t *pdpt = P2V(PDPT_ADDR(pml4[i]));
       freevm_pdpt(pdpt);
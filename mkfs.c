@@ -23,7 +23,8 @@ typedef unsigned char  uchar;
 #define CONSOLE 1
 
 // Disk layout:
-// [ boot block | sb block | free bit map | inode file start | data blocks ]
+// [ boot block | sb block | free bit map | inode file start | data blocks |
+//                                                               swap area ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
@@ -100,15 +101,17 @@ main(int argc, char *argv[])
 
   // 1 fs block = 1 disk sector
   nmeta = 2 + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nblocks = FSSIZE - nmeta - SWAPBLOCKS;
 
   sb.size = xint(FSSIZE);
   sb.nblocks = xint(nblocks);
   sb.bmapstart = xint(2);
   sb.inodestart = xint(2+nbitmap);
+  sb.swapstart = xint(FSSIZE - SWAPBLOCKS);
+  sb.nswap = xint(SWAPBLOCKS);
 
-  printf("nmeta %d (boot, super, bitmap blocks %u) blocks %d total %d\n",
-       nmeta, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, bitmap blocks %u) blocks %d swap %d total %d\n",
+       nmeta, nbitmap, nblocks, SWAPBLOCKS, FSSIZE);
   freeblock = nmeta;     // the first free block that we can allocate
 
   for(i = 0; i < FSSIZE; i++)
@@ -222,6 +225,8 @@ main(int argc, char *argv[])
   printf("inum: %d size %d start: %d nblocks: %d\n",
       inum,xint(din.size), xint(din.data.startblkno), xint(din.data.nblocks));
 
+  // the files must not run into the swap area
+  assert(freeblock <= FSSIZE - SWAPBLOCKS);
   balloc(freeblock);
 
   exit(0);
@@ -0,0 +1,122 @@
+// ctxbench: passes a one-byte token back and forth between two
+// processes, the second spawned from this same program, through a pair
+// of pipes, so that each round trip takes two context switches, and
+// prints how long the rounds took and how many of the page table loads
+// flushed the TLB. Each process writes to every
+// page of a working set on its turn, so switches that keep its TLB
+// entries (PCIDs) show up as fewer page walks.
+//
+// usage: ctxbench [rounds] [pages]
+
+#include <cdefs.h>
+#include <spawn.h>
+#include <sysinfo.h>
+#include <user.h>
+
+#define PAGE 4096   // bytes per page
+#define MAXPAGES 64 // largest working set, in pages
+
+char ws[MAXPAGES * PAGE];
+
+// Stands in for a process doing some work between switches.
+void touch(int npages) {
+  int i;
+
+  for (i = 0; i < npages; i++)
+    ws[i * PAGE]++;
+}
+
+// The other end of the ping-pong, run by "ctxbench -child rounds
+// pages" with the token coming in on descriptor 0 and going back out
+// on descriptor 1. Sends one token first, once its working set is
+// faulted in, to say it is ready.
+void child(int rounds, int npages) {
+  char token = 0;
+  int i;
+
+  touch(npages);
+  write(1, &token, 1);
+  for (i = 0; i < rounds; i++) {
+    read(0, &token, 1);
+    touch(npages);
+    write(1, &token, 1);
+  }
+  exit();
+}
+
+// Runs rounds round trips with a child spawned from prog, each process
+// touching npages pages per turn. args are the child's arguments.
+// Returns the ticks it took.
+int pingpong(char *prog, char **args, int rounds, int npages) {
+  struct spawn_action acts[6];
+  int ping[2], pong[2], i, start;
+  char token = 0;
+
+  if (pipe(ping) < 0 || pipe(pong) < 0) {
+    printf(2, "ctxbench: pipe failed\n");
+    exit();
+  }
+  acts[0].op = SPAWN_DUP2;
+  acts[0].fd = ping[0];
+  acts[0].newfd = 0;
+  acts[1].op = SPAWN_DUP2;
+  acts[1].fd = pong[1];
+  acts[1].newfd = 1;
+  for (i = 0; i < 4; i++) {
+    acts[2 + i].op = SPAWN_CLOSE;
+    acts[2 + i].fd = i < 2 ? ping[i] : pong[i - 2];
+  }
+  if (spawn(prog, args, acts, 6) < 0) {
+    printf(2, "ctxbench: spawn failed\n");
+    exit();
+  }
+  close(ping[0]);
+  close(pong[1]);
+
+  // fault the working set in before the clock starts, and wait for
+  // the child to have done the same
+  touch(npages);
+  read(pong[0], &token, 1);
+  start = uptime();
+  for (i = 0; i < rounds; i++) {
+    write(ping[1], &token, 1);
+    read(pong[0], &token, 1);
+    touch(npages);
+  }
+  wait();
+  close(ping[1]);
+  close(pong[0]);
+  return uptime() - start;
+}
+
+int main(int argc, char *argv[]) {
+  struct sys_info before, after;
+  char *rounds = "10000", *npages = "16";
+  char *args[] = { argv[0], "-child", 0, 0, 0 };
+  int ticks;
+
+  if (argc == 4 && strcmp(argv[1], "-child") == 0)
+    child(atoi(argv[2]), atoi(argv[3]));
+  if (argc > 1)
+    rounds = argv[1];
+  if (argc > 2)
+    npages = argv[2];
+  if (atoi(rounds) <= 0 || atoi(npages) < 0 || atoi(npages) > MAXPAGES) {
+    printf(2, "usage: ctxbench [rounds] [pages <= %d]\n", MAXPAGES);
+    exit();
+  }
+  args[2] = rounds;
+  args[3] = npages;
+
+  sysinfo(&before);
+  ticks = pingpong(argv[0], args, atoi(rounds), atoi(npages));
+  sysinfo(&after);
+
+  printf(1, "%d round trips, %d pages touched per turn: %d ticks\n",
+         atoi(rounds), atoi(npages), ticks);
+  printf(1, "cr3 loads %d, flushing %d, pcid rollovers %d\n",
+         after.cr3_loads - before.cr3_loads,
+         after.cr3_flushes - before.cr3_flushes,
+         after.pcid_rollovers - before.pcid_rollovers);
+  exit();
+}
@@ -1,12 +1,36 @@
 // Simple grep.  Only supports ^ . * $ operators.
 
 #include <cdefs.h>
+#include <mman.h>
 #include <stat.h>
 #include <user.h>
 
 char buf[1024];
 int match(char *, char *);
 
+// Greps a file by mapping it instead of reading it into buf.
+// Returns -1 if fd is not a file that can be mapped.
+int grepmap(char *pattern, int fd) {
+  struct stat st;
+  char *data, *p, *q;
+
+  if (fstat(fd, &st) < 0 || st.type != T_FILE || st.size == 0)
+    return -1;
+  // map one byte past the end, which reads as the '\0' ending the data
+  data = mmap(0, st.size + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == (char *)-1)
+    return -1;
+
+  for (p = data; p < data + st.size; p = q + 1) {
+    if ((q = strchr(p, '\n')) == 0)
+      q = data + st.size;
+    if (match(pattern, p))
+      write(1, p, q - p + (*q == '\n'));
+  }
+  munmap(data, st.size + 1);
+  return 0;
+}
+
 void grep(char *pattern, int fd) {
   int n, m;
   char *p, *q;
@@ -53,7 +77,8 @@ int main(int argc, char *argv[]) {
       printf(1, "grep: cannot open %s\n", argv[i]);
       exit();
     }
-    grep(pattern, fd);
+    if (grepmap(pattern, fd) < 0)
+      grep(pattern, fd);
     close(fd);
   }
   exit();
@@ -61,6 +86,10 @@ int main(int argc, char *argv[]) {
 
 // Regexp matcher from Kernighan & Pike,
 // The Practice of Programming, Chapter 9.
+// Text ends at a '\0' or a newline, so that lines of a mapped file
+// can be matched in place.
+
+#define EOL(c) ((c) == '\0' || (c) == '\n')
 
 int matchhere(char *, char *);
 int matchstar(int, char *, char *);
@@ -71,7 +100,7 @@ int match(char *re, char *text) {
   do { // must look at empty string
     if (matchhere(re, text))
       return 1;
-  } while (*text++ != '\0');
+  } while (!EOL(*text++));
   return 0;
 }
 
@@ -82,8 +111,8 @@ int matchhere(char *re, char *text) {
   if (re[1] == '*')
     return matchstar(re[0], re + 2, text);
   if (re[0] == '$' && re[1] == '\0')
-    return *text == '\0';
-  if (*text != '\0' && (re[0] == '.' || re[0] == *text))
+    return EOL(*text);
+  if (!EOL(*text) && (re[0] == '.' || re[0] == *text))
     return matchhere(re + 1, text + 1);
   return 0;
 }
@@ -93,6 +122,6 @@ int matchstar(int c, char *re, char *text) {
   do { // a * matches zero or more instances
     if (matchhere(re, text))
       return 1;
-  } while (*text != '\0' && (*text++ == c || c == '.'));
+  } while (!EOL(*text) && (*text++ == c || c == '.'));
   return 0;
 }
@@ -19,14 +19,9 @@ int main(void) {
 
   for (;;) {
     printf(1, "init: starting a new shell\n");
-    pid = fork();
+    pid = spawn("sh", argv, 0, 0);
     if (pid < 0) {
-      printf(1, "init: fork failed\n");
-      exit();
-    }
-    if (pid == 0) {
-      exec("sh", argv);
-      printf(1, "init: exec sh failed\n");
+      printf(1, "init: spawn sh failed\n");
       exit();
     }
     while ((wpid = wait()) >= 0 && wpid != pid)
@@ -2,6 +2,7 @@
 
 #include <cdefs.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <user.h>
 #include <test.h>
 
@@ -53,11 +54,98 @@ struct backcmd {
 int fork1(void); // Fork but panics on failure.
 void panic(char *);
 struct cmd *parsecmd(char *);
+void runcmd(struct cmd *);
+
+// Returns whether cmd is a program with redirections only, which
+// spawncmd() can start without forking the shell.
+int simplecmd(struct cmd *cmd) {
+  while (cmd->type == REDIR)
+    cmd = ((struct redircmd *)cmd)->cmd;
+  return cmd->type == EXEC && ((struct execcmd *)cmd)->argv[0] != NULL;
+}
+
+// Starts the simple command cmd in a child, with the nact file actions
+// already in acts followed by those for its redirections.
+// Returns the child's pid, or -1.
+int spawncmd(struct cmd *cmd, struct spawn_action *acts, int nact) {
+  struct execcmd *ecmd;
+  struct redircmd *rcmd;
+  int pid;
+
+  for (; cmd->type == REDIR; cmd = rcmd->cmd) {
+    rcmd = (struct redircmd *)cmd;
+    if (nact == NSPAWNACT) {
+      printf(stderr, "too many redirections\n");
+      return -1;
+    }
+    acts[nact].op = SPAWN_OPEN;
+    acts[nact].fd = rcmd->fd;
+    acts[nact].mode = rcmd->mode;
+    acts[nact].path = rcmd->file;
+    nact++;
+  }
+  ecmd = (struct execcmd *)cmd;
+  if ((pid = spawn(ecmd->argv[0], ecmd->argv, acts, nact)) < 0)
+    printf(stderr, "failed to execute %s\n", ecmd->argv[0]);
+  return pid;
+}
+
+// Frees cmd and the commands it is made of.
+void freecmd(struct cmd *cmd) {
+  if (cmd == NULL) {
+    return;
+  }
+  switch (cmd->type) {
+  case REDIR:
+    freecmd(((struct redircmd *)cmd)->cmd);
+    break;
+  case PIPE:
+    freecmd(((struct pipecmd *)cmd)->left);
+    freecmd(((struct pipecmd *)cmd)->right);
+    break;
+  case LIST:
+    freecmd(((struct listcmd *)cmd)->left);
+    freecmd(((struct listcmd *)cmd)->right);
+    break;
+  case BACK:
+    freecmd(((struct backcmd *)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
+
+// Runs cmd in a child whose descriptor fd is p[end], with both of the
+// pipe p's own descriptors closed.
+// Returns the child's pid, or -1 if it could not be started.
+int pipechild(struct cmd *cmd, int *p, int end, int fd) {
+  struct spawn_action acts[NSPAWNACT];
+  int pid;
+
+  if (simplecmd(cmd)) {
+    acts[0].op = SPAWN_DUP2;
+    acts[0].fd = p[end];
+    acts[0].newfd = fd;
+    acts[1].op = SPAWN_CLOSE;
+    acts[1].fd = p[0];
+    acts[2].op = SPAWN_CLOSE;
+    acts[2].fd = p[1];
+    return spawncmd(cmd, acts, 3);
+  }
+  if ((pid = fork1()) == 0) {
+    assert(close(fd) == 0);
+    assert(dup(p[end]) == fd);
+    assert(close(p[0]) == 0);
+    assert(close(p[1]) == 0);
+    runcmd(cmd);
+  }
+  return pid;
+}
 
 // Execute cmd.  Never returns.
 void runcmd(struct cmd *cmd) {
-  int pid;
+  int pid, n;
   int p[2];
+  struct spawn_action acts[NSPAWNACT];
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
@@ -96,10 +184,15 @@ void runcmd(struct cmd *cmd) {
 
   case LIST:
     lcmd = (struct listcmd *)cmd;
-    if ((pid = fork1()) == 0) {
-      runcmd(lcmd->left);
+    if (simplecmd(lcmd->left)) {
+      if ((pid = spawncmd(lcmd->left, acts, 0)) >= 0)
+        assert(wait() == pid);
+    } else {
+      if ((pid = fork1()) == 0) {
+        runcmd(lcmd->left);
+      }
+      assert(wait() == pid);
     }
-    assert(wait() == pid);
     runcmd(lcmd->right);
     break;
 
@@ -108,24 +201,12 @@ void runcmd(struct cmd *cmd) {
     if (pipe(p) < 0) {
       panic("pipe failed");
     }
-    if (fork1() == 0) {
-      assert(close(stdout) == 0);
-      assert(dup(p[1]) == stdout);
-      assert(close(p[0]) == 0);
-      assert(close(p[1]) == 0);
-      runcmd(pcmd->left);
-    }
-    if (fork1() == 0) {
-      assert(close(stdin) == 0);
-      assert(dup(p[0]) == stdin);
-      assert(close(p[0]) == 0);
-      assert(close(p[1]) == 0);
-      runcmd(pcmd->right);
-    }
+    n = (pipechild(pcmd->left, p, 1, stdout) >= 0) +
+        (pipechild(pcmd->right, p, 0, stdin) >= 0);
     assert(close(p[0]) == 0);
     assert(close(p[1]) == 0);
-    assert(wait() > 0);
-    assert(wait() > 0);
+    while (n-- > 0)
+      assert(wait() > 0);
     break;
 
   case BACK:
@@ -150,6 +231,9 @@ int getcmd(char *buf, int nbuf) {
 
 int main(void) {
   static char buf[100];
+  struct spawn_action acts[NSPAWNACT];
+  struct cmd *cmd;
+  char *s;
   int fd, pid;
 
   // ensure that three file descriptors are open.
@@ -165,6 +249,20 @@ int main(void) {
     if (strcmp(buf, "exit\n") == 0) {
       exit();
     }
+    // a lone program is spawned by the shell itself; anything else is
+    // parsed and run in a forked copy of it. parsecmd() reports syntax
+    // errors without exiting, so they end neither.
+    for (s = buf; *s && !strchr("|&;()", *s); s++)
+      ;
+    if (*s == 0) {
+      if ((cmd = parsecmd(buf)) == NULL) {
+        continue;
+      }
+      if (simplecmd(cmd) && (pid = spawncmd(cmd, acts, 0)) >= 0)
+        assert(wait() == pid);
+      freecmd(cmd);
+      continue;
+    }
     if ((pid = fork1()) == 0) {
       runcmd(parsecmd(buf));
     }
@@ -317,16 +415,35 @@ struct cmd *parsepipe(char **, char *);
 struct cmd *parseexec(char **, char *);
 struct cmd *nulterminate(struct cmd *);
 
+int parsefailed; // set by parseerror() until parsecmd() returns
+
+// Reports the syntax error s, unless one was reported already for the
+// command being parsed. The parser then stops where it is and
+// parsecmd() fails.
+void parseerror(char *s) {
+  if (!parsefailed) {
+    printf(stderr, "%s\n", s);
+  }
+  parsefailed = 1;
+}
+
+// Parses the command line s.
+// Returns the command, or NULL after reporting a syntax error.
 struct cmd *parsecmd(char *s) {
   char *es;
   struct cmd *cmd;
 
   es = s + strlen(s);
+  parsefailed = 0;
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if (s != es) {
+  if (s != es && !parsefailed) {
     printf(stderr, "leftovers: %s\n", s);
-    panic("syntax");
+    parseerror("syntax");
+  }
+  if (parsefailed) {
+    freecmd(cmd);
+    return NULL;
   }
   nulterminate(cmd);
   return cmd;
@@ -362,10 +479,11 @@ struct cmd *parseredirs(struct cmd *cmd, char **ps, char *es) {
   int tok;
   char *q, *eq;
 
-  while (peek(ps, es, "<>")) {
+  while (!parsefailed && peek(ps, es, "<>")) {
     tok = gettoken(ps, es, 0, 0);
     if (gettoken(ps, es, &q, &eq) != 'a') {
-      panic("missing file for redirection");
+      parseerror("missing file for redirection");
+      break;
     }
     switch (tok) {
     case '<':
@@ -391,7 +509,8 @@ struct cmd *parseblock(char **ps, char *es) {
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
   if (!peek(ps, es, ")")) {
-    panic("syntax - missing )");
+    parseerror("syntax - missing )");
+    return cmd;
   }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
@@ -413,19 +532,21 @@ struct cmd *parseexec(char **ps, char *es) {
 
   argc = 0;
   ret = parseredirs(ret, ps, es);
-  while (!peek(ps, es, "|)&;")) {
+  while (!parsefailed && !peek(ps, es, "|)&;")) {
     if ((tok = gettoken(ps, es, &q, &eq)) == 0) {
       break;
     }
     if (tok != 'a') {
-      panic("syntax");
+      parseerror("syntax");
+      break;
+    }
+    if (argc == MAXARGS - 1) {
+      parseerror("too many args");
+      break;
     }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if (argc >= MAXARGS) {
-      panic("too many args");
-    }
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -0,0 +1,168 @@
+// shmbench: moves data from one process to another, first through a
+// pipe and then through a shared memory segment, and prints how long
+// each took. The consumer is a process spawned from this same program.
+//
+// usage: shmbench [kbytes]
+
+#include <cdefs.h>
+#include <spawn.h>
+#include <user.h>
+
+#define CHUNK 1024        // bytes per pipe write, at most a pipe buffer
+#define SHMSIZE (64 * 1024) // bytes handed over per round through shm
+
+char buf[CHUNK];
+int sum;
+
+// Stands in for the consumer doing something with the data.
+void consume(char *p, int n) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    sum += p[i];
+}
+
+// The consumer of pipebench(), run by "shmbench -pipe kbytes" with the
+// data coming in on descriptor 0.
+void pipechild(int total) {
+  int n;
+
+  for (n = 0; n < total; n += CHUNK) {
+    read(0, buf, CHUNK);
+    consume(buf, CHUNK);
+  }
+  exit();
+}
+
+// The consumer of shmbench(), run by "shmbench -shm kbytes" with the
+// tokens coming in on descriptor 0 and going back out on descriptor 1.
+// The id of the segment comes in first, through the same pipe.
+void shmchild(int total) {
+  int id, n;
+  char *shm, token;
+
+  if (read(0, &id, sizeof(id)) != sizeof(id) ||
+      (shm = shmattach(id)) == (char *)-1) {
+    printf(2, "shmbench: cannot attach shared memory\n");
+    exit();
+  }
+  for (n = 0; n < total; n += SHMSIZE) {
+    read(0, &token, 1);
+    consume(shm, SHMSIZE);
+    write(1, &token, 1);
+  }
+  shmdetach(shm);
+  exit();
+}
+
+// Spawns prog with args, with descriptor 0 of the child reading from
+// in and, if out is not -1, descriptor 1 writing to out. fds are the
+// nfds descriptors the child should not inherit.
+void spawnchild(char *prog, char **args, int in, int out, int *fds,
+                int nfds) {
+  struct spawn_action acts[2 + 4];
+  int n = 0, i;
+
+  acts[n].op = SPAWN_DUP2;
+  acts[n].fd = in;
+  acts[n++].newfd = 0;
+  if (out >= 0) {
+    acts[n].op = SPAWN_DUP2;
+    acts[n].fd = out;
+    acts[n++].newfd = 1;
+  }
+  for (i = 0; i < nfds; i++) {
+    acts[n].op = SPAWN_CLOSE;
+    acts[n++].fd = fds[i];
+  }
+  if (spawn(prog, args, acts, n) < 0) {
+    printf(2, "shmbench: spawn failed\n");
+    exit();
+  }
+}
+
+// Sends total bytes through a pipe, CHUNK at a time, to a child
+// spawned from prog with args.
+// Returns the ticks it took.
+int pipebench(char *prog, char **args, int total) {
+  int p[2], n, start;
+
+  if (pipe(p) < 0) {
+    printf(2, "shmbench: pipe failed\n");
+    exit();
+  }
+  start = uptime();
+  spawnchild(prog, args, p[0], -1, p, 2);
+  close(p[0]);
+  for (n = 0; n < total; n += CHUNK) {
+    memset(buf, n, CHUNK);
+    write(p[1], buf, CHUNK);
+  }
+  close(p[1]);
+  wait();
+  return uptime() - start;
+}
+
+// Hands total bytes over through a shared memory segment, SHMSIZE at
+// a time, to a child spawned from prog with args. Only one-byte tokens
+// go through the pipes, to say whose turn it is.
+// Returns the ticks it took.
+int shmbench(char *prog, char **args, int total) {
+  int full[2], empty[2], fds[4], id, n, start;
+  char *shm, token = 0;
+
+  if ((id = shmcreate(getpid(), SHMSIZE)) < 0 ||
+      (shm = shmattach(id)) == (char *)-1) {
+    printf(2, "shmbench: cannot set up shared memory\n");
+    exit();
+  }
+  if (pipe(full) < 0 || pipe(empty) < 0) {
+    printf(2, "shmbench: pipe failed\n");
+    exit();
+  }
+  fds[0] = full[0];
+  fds[1] = full[1];
+  fds[2] = empty[0];
+  fds[3] = empty[1];
+  start = uptime();
+  spawnchild(prog, args, full[0], empty[1], fds, 4);
+  close(full[0]);
+  close(empty[1]);
+  write(full[1], &id, sizeof(id));
+  for (n = 0; n < total; n += SHMSIZE) {
+    memset(shm, n, SHMSIZE);
+    write(full[1], &token, 1);
+    read(empty[0], &token, 1);
+  }
+  wait();
+  close(full[1]);
+  close(empty[0]);
+  shmdetach(shm);
+  shmremove(id);
+  return uptime() - start;
+}
+
+int main(int argc, char *argv[]) {
+  char *kbytes = "4096";
+  char *args[] = { argv[0], 0, 0, 0 };
+
+  if (argc == 3 && strcmp(argv[1], "-pipe") == 0)
+    pipechild(atoi(argv[2]) * 1024);
+  if (argc == 3 && strcmp(argv[1], "-shm") == 0)
+    shmchild(atoi(argv[2]) * 1024);
+  if (argc > 1)
+    kbytes = argv[1];
+  if (atoi(kbytes) <= 0) {
+    printf(2, "usage: shmbench [kbytes]\n");
+    exit();
+  }
+  args[2] = kbytes;
+
+  args[1] = "-pipe";
+  printf(1, "pipe: %d KB in %d ticks\n", atoi(kbytes),
+         pipebench(argv[0], args, atoi(kbytes) * 1024));
+  args[1] = "-shm";
+  printf(1, "shm: %d KB in %d ticks\n", atoi(kbytes),
+         shmbench(argv[0], args, atoi(kbytes) * 1024));
+  exit();
+}
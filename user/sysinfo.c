@@ -6,13 +6,64 @@
 
 int main(int argc, char *argv[]) {
   struct sys_info info;
+  int i, ratio;
   sysinfo(&info);
 
   printf(1, "pages_in_use = %d\n", info.pages_in_use);
   printf(1, "pages_in_swap = %d\n", info.pages_in_swap);
   printf(1, "free_pages = %d\n", info.free_pages);
   printf(1, "num_page_faults = %d\n", info.num_page_faults);
+  printf(1, "num_minor_faults = %d\n", info.num_minor_faults);
+  printf(1, "num_major_faults = %d\n", info.num_major_faults);
   printf(1, "num_disk_reads = %d\n", info.num_disk_reads);
+  printf(1, "kmag_hits = %d\n", info.kmag_hits);
+  printf(1, "kmag_refills = %d\n", info.kmag_refills);
+  printf(1, "kmag_drains = %d\n", info.kmag_drains);
+  printf(1, "free_blocks =");
+  for (i = 0; i < KALLOC_NORDER; i++)
+    printf(1, " %d", info.free_blocks[i]);
+  printf(1, "\n");
+  printf(1, "zero_hits = %d\n", info.zero_hits);
+  printf(1, "zero_misses = %d\n", info.zero_misses);
+  printf(1, "zero_pool = %d\n", info.zero_pool);
+  printf(1, "vspace_full_updates = %d\n", info.vspace_full_updates);
+  printf(1, "vspace_range_updates = %d\n", info.vspace_range_updates);
+  printf(1, "cr3_loads = %d\n", info.cr3_loads);
+  printf(1, "cr3_flushes = %d\n", info.cr3_flushes);
+  printf(1, "pcid_rollovers = %d\n", info.pcid_rollovers);
+  printf(1, "faultaround_mapped = %d\n", info.faultaround_mapped);
+  printf(1, "faultaround_used = %d\n", info.faultaround_used);
+  printf(1, "faultaround_unused = %d\n", info.faultaround_unused);
+  printf(1, "evictions = %d\n", info.evictions);
+  printf(1, "refaults = %d\n", info.refaults);
+  printf(1, "zeropage_maps = %d\n", info.zeropage_maps);
+  printf(1, "zeropage_faults = %d\n", info.zeropage_faults);
+  printf(1, "swap_outs = %d\n", info.swap_outs);
+  printf(1, "swap_ins = %d\n", info.swap_ins);
+  printf(1, "swap_ahead = %d\n", info.swap_ahead);
+  printf(1, "swap_ios = %d\n", info.swap_ios);
+  printf(1, "zswap_pages = %d\n", info.zswap_pages);
+  printf(1, "zswap_bytes = %d (max %d KB)\n", info.zswap_bytes,
+         info.zswap_max);
+  if (info.zswap_bytes > 0) {
+    ratio = info.zswap_pages * 4096 * 10 / info.zswap_bytes;
+    printf(1, "zswap_ratio = %d.%d\n", ratio / 10, ratio % 10);
+  }
+  if (info.zswap_hits + info.zswap_misses > 0)
+    printf(1, "zswap_hit_rate = %d%%\n",
+           info.zswap_hits * 100 / (info.zswap_hits + info.zswap_misses));
+  printf(1, "pcache_pages = %d\n", info.pcache_pages);
+  printf(1, "pcache_shared = %d\n", info.pcache_shared);
+  printf(1, "pcache_hits = %d\n", info.pcache_hits);
+  printf(1, "pcache_misses = %d\n", info.pcache_misses);
+  printf(1, "exec_count = %d\n", info.exec_count);
+  if (info.exec_count > 0)
+    printf(1, "exec_cycles = %d per exec\n",
+           (int)(info.exec_cycles / info.exec_count));
+  printf(1, "spawn_count = %d\n", info.spawn_count);
+  if (info.spawn_count > 0)
+    printf(1, "spawn_cycles = %d per spawn\n",
+           (int)(info.spawn_cycles / info.spawn_count));
 
   exit();
 }
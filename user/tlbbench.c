@@ -0,0 +1,87 @@
+// tlbbench: reads one word from every page of a heap buffer, over and
+// over, in a scattered order, once with the heap on 4KB pages and once
+// with it on 2MB pages (vmtune(VMT_HEAPLARGE)), each time in a process
+// spawned from this same program, and prints how long
+// each took and how many page faults filling the buffer in cost. The
+// buffer spans more pages than the TLB holds 4KB entries for, so the
+// difference is the cost of the TLB misses that 2MB pages avoid.
+//
+// usage: tlbbench [mbytes] [passes]
+
+#include <cdefs.h>
+#include <sysinfo.h>
+#include <user.h>
+#include <vmtune.h>
+
+#define PAGE 4096                // bytes per page
+#define LARGE (2 * 1024 * 1024)  // bytes per 2MB page
+#define STEP 257                 // pages between two reads
+
+int sum;
+
+// Runs the benchmark on the heap of this process, which must still be
+// fresh, with large telling whether the heap is on 2MB pages. Called
+// in a child run as "tlbbench -run large mbytes passes".
+void run(int large, int mbytes, int passes) {
+  struct sys_info before, after;
+  int npages, faults, i, j, k, start;
+  char *p;
+  uint64_t cur;
+
+  if (vmtune(VMT_HEAPLARGE, large) < 0) {
+    printf(2, "tlbbench: vmtune failed\n");
+    exit();
+  }
+  // only whole, aligned 2MB ranges of the heap get 2MB pages
+  cur = (uint64_t)sbrk(0);
+  if (sbrk((LARGE - cur % LARGE) % LARGE) == (char *)-1 ||
+      (p = sbrk(mbytes * 1024 * 1024)) == (char *)-1) {
+    printf(2, "tlbbench: sbrk failed\n");
+    exit();
+  }
+
+  npages = mbytes * 1024 * 1024 / PAGE;
+  sysinfo(&before);
+  for (i = 0; i < npages; i++)
+    p[i * PAGE] = i;
+  sysinfo(&after);
+  faults = after.num_page_faults - before.num_page_faults;
+
+  start = uptime();
+  for (k = 0; k < passes; k++)
+    for (i = 0, j = 0; i < npages; i++, j = (j + STEP) % npages)
+      sum += p[j * PAGE];
+  printf(1, "%s pages: %d MB, %d passes in %d ticks, %d faults to fill\n",
+         large ? "2MB" : "4KB", mbytes, passes, uptime() - start, faults);
+  exit();
+}
+
+int main(int argc, char *argv[]) {
+  char *mbytes = "8", *passes = "2000";
+  char *args[] = { argv[0], "-run", 0, 0, 0, 0 };
+  int large;
+
+  if (argc == 5 && strcmp(argv[1], "-run") == 0)
+    run(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+  if (argc > 1)
+    mbytes = argv[1];
+  if (argc > 2)
+    passes = argv[2];
+  if (atoi(mbytes) <= 0 || atoi(passes) <= 0) {
+    printf(2, "usage: tlbbench [mbytes] [passes]\n");
+    exit();
+  }
+  args[3] = mbytes;
+  args[4] = passes;
+
+  // each run gets a fresh heap in a process of its own
+  for (large = 0; large <= 1; large++) {
+    args[2] = large ? "1" : "0";
+    if (spawn(argv[0], args, 0, 0) < 0) {
+      printf(2, "tlbbench: spawn failed\n");
+      exit();
+    }
+    wait();
+  }
+  exit();
+}
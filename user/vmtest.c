@@ -0,0 +1,362 @@
+#include <cdefs.h>
+#include <fcntl.h>
+#include <mman.h>
+#include <spawn.h>
+#include <stat.h>
+#include <stdarg.h>
+#include <sysinfo.h>
+#include <vmtune.h>
+#include <user.h>
+#include <test.h>
+
+#define NPAGES 16      // heap pages that cow_write writes
+#define OVERCOMMIT 256 // pages the swap tests use beyond free memory
+#define SHMKEY 0x766d  // key of the segment that shm_share creates
+
+void run_test(char*);
+void cow_write(void);
+void mmap_file(void);
+void spawn_actions(void);
+void shm_share(void);
+void swap_roundtrip(void);
+void zswap_roundtrip(void);
+
+int main(int argc, char *argv[]) {
+  char buf[40];
+  while (true) {
+    shell_prompt("vm");
+    memset(buf, 0, sizeof(buf));
+    gets(buf, sizeof(buf));
+    if (buf[0] == 0) {
+      continue;
+    }
+    run_test(buf);
+  }
+
+  exit();
+  return 0;
+}
+
+void run_test(char* test) {
+  if (strcmp(test, "all\n") == 0) {
+    cow_write();
+    mmap_file();
+    spawn_actions();
+    shm_share();
+    swap_roundtrip();
+    zswap_roundtrip();
+    pass("vm tests");
+  } else if (strcmp(test, "exit\n") == 0) {
+    exit();
+  } else if (strcmp(test, "cow_write\n") == 0) {
+    cow_write();
+  } else if (strcmp(test, "mmap_file\n") == 0) {
+    mmap_file();
+  } else if (strcmp(test, "spawn_actions\n") == 0) {
+    spawn_actions();
+  } else if (strcmp(test, "shm_share\n") == 0) {
+    shm_share();
+  } else if (strcmp(test, "swap_roundtrip\n") == 0) {
+    swap_roundtrip();
+  } else if (strcmp(test, "zswap_roundtrip\n") == 0) {
+    zswap_roundtrip();
+  } else {
+    printf(stderr, "input matches no test: %s" , test);
+  }
+}
+
+// returns 1 if the n bytes at a and b are the same
+int same(char *a, char *b, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// writes to copy-on-write pages from both sides of a fork, and checks
+// that each side only ever sees its own data
+void cow_write(void) {
+  test("cow_write");
+
+  char *a;
+  int i, pid;
+
+  a = sbrk(NPAGES * PGSIZE);
+  if (a == (char*) -1) {
+    error("cow_write: failed to grow the heap");
+  }
+  for (i = 0; i < NPAGES; i++) {
+    a[i * PGSIZE] = i;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    error("cow_write: fork failed");
+  }
+  if (pid == 0) {
+    for (i = 0; i < NPAGES; i++) {
+      assert(a[i * PGSIZE] == i);
+      a[i * PGSIZE] = i + 1;
+    }
+    for (i = 0; i < NPAGES; i++) {
+      assert(a[i * PGSIZE] == i + 1);
+    }
+    exit();
+  }
+  assert(wait() == pid);
+
+  // the child's writes went to copies
+  for (i = 0; i < NPAGES; i++) {
+    assert(a[i * PGSIZE] == i);
+    a[i * PGSIZE] = i + 2;
+  }
+  for (i = 0; i < NPAGES; i++) {
+    assert(a[i * PGSIZE] == i + 2);
+  }
+  pass("");
+}
+
+// maps small.txt and checks it against read(), that private writes
+// stay private, and that an unmapped range can no longer be accessed
+void mmap_file(void) {
+  test("mmap_file");
+
+  char buf[64], *p, *q;
+  volatile char b;
+  int fd, n, pid;
+
+  if ((fd = open("small.txt", O_RDONLY)) < 0) {
+    error("mmap_file: cannot open small.txt");
+  }
+  n = read(fd, buf, sizeof(buf));
+  assert(n > 0);
+
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  q = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == (char*) -1 || q == (char*) -1) {
+    error("mmap_file: mmap failed");
+  }
+  assert(same(p, buf, n));
+  assert(same(q, buf, n));
+
+  // a private write is seen neither by other mappings nor by read()
+  p[0] = buf[0] + 1;
+  assert(p[0] == buf[0] + 1);
+  assert(q[0] == buf[0]);
+  close(fd);
+  fd = open("small.txt", O_RDONLY);
+  assert(read(fd, buf, sizeof(buf)) == n);
+  assert(q[0] == buf[0]);
+
+  // shared writable mappings need a file open for reading and writing,
+  // and the offset has to be page aligned
+  assert(mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == (void*) -1);
+  assert(mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 1) == (void*) -1);
+  close(fd);
+
+  assert(munmap(p, PGSIZE) == 0);
+  assert(munmap(q, PGSIZE) == 0);
+
+  printf(stdout, "\nthe next process should be killed with trap 14\n");
+  pid = fork();
+  if (pid < 0) {
+    error("mmap_file: fork failed");
+  }
+  if (pid == 0) {
+    b = p[0];
+    error("mmap_file: could read unmapped memory, %d", b);
+  }
+  assert(wait() == pid);
+  pass("");
+}
+
+// spawns cat with its input opened from small.txt and its output
+// moved to a pipe, and checks what comes out of the pipe
+void spawn_actions(void) {
+  test("spawn_actions");
+
+  struct spawn_action acts[NSPAWNACT + 1];
+  char *args[] = { "cat", 0 };
+  char want[64], got[64];
+  int fd, p[2], n, m, k, pid;
+
+  if ((fd = open("small.txt", O_RDONLY)) < 0) {
+    error("spawn_actions: cannot open small.txt");
+  }
+  n = read(fd, want, sizeof(want));
+  close(fd);
+  assert(pipe(p) == 0);
+
+  acts[0].op = SPAWN_OPEN;
+  acts[0].fd = 0;
+  acts[0].path = "small.txt";
+  acts[0].mode = O_RDONLY;
+  acts[1].op = SPAWN_DUP2;
+  acts[1].fd = p[1];
+  acts[1].newfd = 1;
+  acts[2].op = SPAWN_CLOSE;
+  acts[2].fd = p[0];
+  acts[3].op = SPAWN_CLOSE;
+  acts[3].fd = p[1];
+  if ((pid = spawn("cat", args, acts, 4)) < 0) {
+    error("spawn_actions: spawn failed");
+  }
+  close(p[1]);
+
+  // the child closed its copy of the write end, so read() sees the end
+  for (m = 0; m < sizeof(got) && (k = read(p[0], got + m, sizeof(got) - m)) > 0; m += k)
+    ;
+  close(p[0]);
+  assert(wait() == pid);
+  assert(m == n);
+  assert(same(got, want, n));
+
+  // failing file actions and missing programs fail the spawn
+  acts[0].path = "nosuchfile";
+  assert(spawn("cat", args, acts, 1) < 0);
+  assert(spawn("nosuchprogram", args, 0, 0) < 0);
+  assert(spawn("cat", args, acts, NSPAWNACT + 1) < 0);
+  pass("");
+}
+
+// shares a segment with a child, then removes it, and checks that
+// the key is free again while the old attachment stays usable
+void shm_share(void) {
+  test("shm_share");
+
+  char *p, *q;
+  int id, id2, pid;
+
+  if ((id = shmcreate(SHMKEY, 2 * PGSIZE)) < 0 ||
+      (p = shmattach(id)) == (char*) -1) {
+    error("shm_share: cannot set up shared memory");
+  }
+  assert(shmcreate(SHMKEY, 2 * PGSIZE) == id);
+  assert(p[0] == 0 && p[PGSIZE] == 0);
+
+  // fork() shares the attachment rather than copying it
+  pid = fork();
+  if (pid < 0) {
+    error("shm_share: fork failed");
+  }
+  if (pid == 0) {
+    p[0] = 'x';
+    p[PGSIZE] = 'y';
+    assert(shmdetach(p) == 0);
+    exit();
+  }
+  assert(wait() == pid);
+  assert(p[0] == 'x' && p[PGSIZE] == 'y');
+
+  assert(shmremove(id) == 0);
+  assert(shmremove(id) == -1);
+  assert(shmattach(id) == (void*) -1);
+  if ((id2 = shmcreate(SHMKEY, PGSIZE)) < 0 ||
+      (q = shmattach(id2)) == (char*) -1) {
+    error("shm_share: cannot reuse the key of a removed segment");
+  }
+  assert(q[0] == 0);
+  assert(p[0] == 'x');
+
+  assert(shmdetach(p) == 0);
+  assert(shmdetach(q) == 0);
+  assert(shmdetach(q) == -1);
+  assert(shmremove(id2) == 0);
+  pass("");
+}
+
+// grows the heap by OVERCOMMIT pages more than are free, in a child,
+// writes a pattern to every page, which pushes pages out to swap, and
+// checks that the pattern comes back
+void swap_fill(char *name) {
+  struct sys_info info;
+  char *a;
+  int i, n;
+
+  assert(sysinfo(&info) == 0);
+  n = info.free_pages + OVERCOMMIT;
+  // one page at a time, as n pages may not fit in an int of bytes
+  if ((a = sbrk(PGSIZE)) == (char*) -1) {
+    error("%s: failed to grow the heap", name);
+  }
+  for (i = 1; i < n; i++) {
+    if (sbrk(PGSIZE) == (char*) -1) {
+      error("%s: failed to grow the heap", name);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    *(int*)(a + (uint64_t)i * PGSIZE) = i;
+    *(int*)(a + (uint64_t)i * PGSIZE + PGSIZE - sizeof(int)) = ~i;
+  }
+  for (i = 0; i < n; i++) {
+    assert(*(int*)(a + (uint64_t)i * PGSIZE) == i);
+    assert(*(int*)(a + (uint64_t)i * PGSIZE + PGSIZE - sizeof(int)) == ~i);
+  }
+}
+
+// runs swap_fill() with the compressed store turned off, so pages go
+// to the swap area on the disk, and checks that they were read back
+void swap_roundtrip(void) {
+  test("swap_roundtrip");
+
+  struct sys_info info1, info2;
+  int old, pid;
+
+  old = vmtune(VMT_ZSWAPMAX, 0);
+  assert(old >= 0);
+  assert(sysinfo(&info1) == 0);
+  pid = fork();
+  if (pid < 0) {
+    error("swap_roundtrip: fork failed");
+  }
+  if (pid == 0) {
+    swap_fill("swap_roundtrip");
+    exit();
+  }
+  assert(wait() == pid);
+  assert(sysinfo(&info2) == 0);
+  assert(vmtune(VMT_ZSWAPMAX, old) == 0);
+
+  printf(stdout, "\nswap_roundtrip: %d pages out, %d in, %d disk requests\n",
+         info2.swap_outs - info1.swap_outs, info2.swap_ins - info1.swap_ins,
+         info2.swap_ios - info1.swap_ios);
+  assert(info2.swap_outs > info1.swap_outs);
+  assert(info2.swap_ins > info1.swap_ins);
+  assert(info2.swap_ios > info1.swap_ios);
+  pass("");
+}
+
+// runs swap_fill() with room in the compressed store, whose pages
+// the pattern fills compress well, and checks that they went there
+void zswap_roundtrip(void) {
+  test("zswap_roundtrip");
+
+  struct sys_info info1, info2;
+  int old, pid;
+
+  old = vmtune(VMT_ZSWAPMAX, ZSWAPMAX);
+  assert(old >= 0);
+  assert(sysinfo(&info1) == 0);
+  pid = fork();
+  if (pid < 0) {
+    error("zswap_roundtrip: fork failed");
+  }
+  if (pid == 0) {
+    swap_fill("zswap_roundtrip");
+    exit();
+  }
+  assert(wait() == pid);
+  assert(sysinfo(&info2) == 0);
+  assert(vmtune(VMT_ZSWAPMAX, old) == ZSWAPMAX);
+
+  printf(stdout, "\nzswap_roundtrip: %d pages out, %d read back from memory, %d from disk\n",
+         info2.swap_outs - info1.swap_outs, info2.zswap_hits - info1.zswap_hits,
+         info2.zswap_misses - info1.zswap_misses);
+  assert(info2.swap_outs > info1.swap_outs);
+  assert(info2.zswap_hits > info1.zswap_hits);
+  pass("");
+}